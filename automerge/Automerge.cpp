@@ -3,6 +3,7 @@
 
 #include "Automerge.h"
 #include <sstream>
+#include <fstream>
 #include <list>
 #include <charconv>
 
@@ -33,14 +34,7 @@ usize Automerge::get_actor_index() {
 
 TransactionInner Automerge::transaction_inner() {
     usize actor = get_actor_index();
-    u64 seq = 0;
-    try {
-        auto& state = states.at(actor);
-        seq = state.size() + 1;
-    }
-    catch (std::out_of_range&) {
-        seq = 1;
-    }
+    u64 seq = (actor < states->size() ? (*states)[actor].size() : 0) + 1;
     auto deps = get_heads();
     if (seq > 1) {
         auto last_hash = get_hash(actor, seq - 1);
@@ -69,6 +63,8 @@ TransactionInner Automerge::transaction_inner() {
 }
 
 std::pair<std::vector<ExId>, ChangeHash> Automerge::transact_with(CommitOptionsFunc c, TransactionFunc f) {
+    ensure_transaction_closed();
+
     auto tx = transaction();
     auto result = f(tx);
 
@@ -110,6 +106,8 @@ usize Automerge::length(const ExId& obj) const {
 }
 
 usize Automerge::length_at(const ExId& obj, const std::vector<ChangeHash>& heads) const {
+    check_not_collected(heads);
+
     try {
         auto [inner_obj, obj_type] = exid_to_obj(obj);
         auto clock = clock_at(heads);
@@ -220,21 +218,85 @@ Automerge Automerge::load_with(const BinSlice& data, OpObserver* options) {
     return doc;
 }
 
-bool Automerge::duplicate_seq(const Change& change) const {
-    bool dup = false;
-    auto actor_index = ops.m.actors.lookup(change.actor_id());
-    if (actor_index) {
-        auto state = states.find(*actor_index);
-        if (state != states.end()) {
-            dup = (state->second.size() >= change.seq);
+Automerge Automerge::load_shared_with(const SharedBytes& data, OpObserver* options) {
+    auto changes = load_document(data);
+    Automerge doc;
+    doc.apply_changes_with(std::move(changes), options);
+
+    return doc;
+}
+
+Automerge Automerge::load_file(const std::string& path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        throw std::runtime_error("failed to open " + path);
+    }
+
+    auto size = file.tellg();
+    auto data = std::make_shared<std::vector<u8>>((usize)size);
+    file.seekg(0);
+    if (!file.read(reinterpret_cast<char*>(data->data()), size)) {
+        throw std::runtime_error("failed to read " + path);
+    }
+
+    return load_shared(data);
+}
+
+usize Automerge::load_incremental_with(const BinSlice& data, OpObserver* options) {
+    ensure_transaction_closed();
+
+    // Only the bytes of an incomplete chunk are kept between calls, complete chunks are decoded
+    // straight from `data`. The kept bytes are appended to in place, so a large chunk fed in small
+    // pieces is copied once.
+    usize tail_len = incremental_tail.size();
+    BinSlice bytes = data;
+    if (tail_len) {
+        incremental_tail.insert(incremental_tail.end(), data.first, data.first + data.second);
+        bytes = make_bin_slice(incremental_tail);
+    }
+
+    std::vector<BinSlice> blocks;
+    std::vector<Change> changes;
+    usize consumed = 0;
+    try {
+        consumed = Change::split_complete_blocks(bytes, blocks);
+        for (auto& block : blocks) {
+            Change::decode_block(block, changes);
         }
     }
-    return dup;
+    catch (...) {
+        // keep the bytes buffered before this call
+        incremental_tail.resize(tail_len);
+        throw;
+    }
+
+    if (tail_len) {
+        incremental_tail.erase(incremental_tail.begin(), incremental_tail.begin() + consumed);
+    }
+    else {
+        incremental_tail.assign(bytes.first + consumed, bytes.first + bytes.second);
+    }
+
+    if (changes.empty()) {
+        return 0;
+    }
+
+    usize start = ops.len();
+    apply_changes_with(std::move(changes), options);
+
+    return ops.len() - start;
+}
+
+bool Automerge::duplicate_seq(const Change& change) const {
+    auto actor_index = ops.m.actors.lookup(change.actor_id());
+    return actor_index && (*actor_index < states->size()) && ((*states)[*actor_index].size() >= change.seq);
 }
 
 void Automerge::apply_changes_with(std::vector<Change>&& changes, OpObserver* options) {
+    ensure_transaction_closed();
+
     for (auto& c : changes) {
-        if (histroy_index.count(c.hash)) {
+        if (histroy_index->count(c.hash)) {
             continue;
         }
 
@@ -242,11 +304,18 @@ void Automerge::apply_changes_with(std::vector<Change>&& changes, OpObserver* op
             throw AutomergeError{ AutomergeError::DuplicateSeqNumber, ActorIdPair{ c.seq, c.actor_id() } };
         }
 
-        if (is_causally_ready(c)) {
+        std::vector<ChangeHash> missing;
+        for (auto& d : c.deps) {
+            if (!histroy_index->count(d)) {
+                missing.push_back(d);
+            }
+        }
+
+        if (missing.empty()) {
             apply_change(std::move(c), options);
         }
         else {
-            queue.push_back(std::move(c));
+            queue.push(std::move(c), missing);
         }
     }
 
@@ -256,13 +325,13 @@ void Automerge::apply_changes_with(std::vector<Change>&& changes, OpObserver* op
             break;
         }
 
-        if (!histroy_index.count(c->hash)) {
+        if (!histroy_index->count(c->hash)) {
             apply_change(std::move(*c), options);
         }
     }
 
     // TODO: optimize to_json
-    json_doc = *this;
+    json_doc = std::make_shared<json>(*this);
 }
 
 void Automerge::apply_change(Change&& change, OpObserver* observer) {
@@ -276,76 +345,22 @@ void Automerge::apply_change(Change&& change, OpObserver* observer) {
 
 bool Automerge::is_causally_ready(const Change& change) const {
     return std::all_of(change.deps.cbegin(), change.deps.cend(), [&](const ChangeHash& d) {
-        return histroy_index.count(d);
+        return histroy_index->count(d);
         });
 }
 
 std::optional<Change> Automerge::pop_next_causally_ready_change() {
-    usize index = 0;
-    while (index < queue.size()) {
-        if (is_causally_ready(queue[index])) {
-            auto res = Change(std::move(queue[index]));
-            if (index == queue.size() - 1) {
-                queue.pop_back();
-            }
-            else {
-                queue[index] = vector_pop(queue);
-            }
-            return { std::move(res) };
-        }
-        ++index;
-    }
-
-    return {};
+    return queue.pop_ready();
 }
 
 std::vector<std::pair<ObjId, Op>> Automerge::imports_ops(const Change& change) {
     std::vector<std::pair<ObjId, Op>> res;
-    auto op_iter = change.iter_ops();
-
-    usize i = 0;
-    std::optional<OldOp> c;
-    while ((c = op_iter.next())) {
-        usize actor = ops.m.cache_actor(ActorId(change.actor_id()));
-        OpId id{ change.start_op + i, std::move(actor) };
+    res.reserve(change.len());
 
-        ObjId obj;
-        if (c->obj.isRoot) {
-            obj = ROOT;
-        }
-        else {
-            obj.counter = c->obj.id.counter;
-            obj.actor = ops.m.cache_actor(std::move(c->obj.id.actor));
-        }
-
-        auto pred = ops.m.import_opids(std::move(c->pred));
-
-        Key key;
-        if (c->key.tag == OldKey::MAP) {
-            key = Key{ Key::Map, ops.m.cache_prop(std::get<std::string_view>(std::move(c->key.data))) };
-        }
-        else {
-            auto& elem_id = std::get<OldElementId>(c->key.data);
-            if (elem_id.isHead) {
-                key = Key{ Key::Seq, HEAD };
-            }
-            else {
-                key = Key{ Key::Seq, ElemId{ elem_id.id.counter, ops.m.cache_actor(std::move(elem_id.id.actor)) } };
-            }
-        }
-
-        res.emplace_back(
-            std::move(obj),
-            Op{
-                std::move(id),
-                std::move(c->action),
-                std::move(key),
-                {},
-                std::move(pred),
-                c->insert
-            });
-
-        ++i;
+    auto op_iter = change.import_ops(ops.m);
+    std::optional<std::pair<ObjId, Op>> op;
+    while ((op = op_iter.next())) {
+        res.push_back(std::move(*op));
     }
 
     return res;
@@ -360,7 +375,17 @@ std::vector<ChangeHash> Automerge::merge(Automerge&& other) {
 }
 
 std::vector<ChangeHash> Automerge::merge_with(Automerge& other, OpObserver* options) {
+    ensure_transaction_closed();
+    other.ensure_transaction_closed();
+
     auto changes_ptr = get_changes_added(other);
+    if (std::any_of(changes_ptr.cbegin(), changes_ptr.cend(), [](const Change* change) { return change->compacted; })) {
+        // the ops of compacted changes are only in the op set of `other`
+        auto bytes = other.snapshot();
+        apply_changes_with(Change::load_blocks(make_bin_slice(bytes)), options);
+        return get_heads();
+    }
+
     std::vector<Change> changes;
     changes.reserve(changes_ptr.size());
     std::transform(changes_ptr.cbegin(), changes_ptr.cend(), std::back_inserter(changes),
@@ -372,58 +397,138 @@ std::vector<ChangeHash> Automerge::merge_with(Automerge& other, OpObserver* opti
 }
 
 std::vector<u8> Automerge::save() {
-    auto bytes = encode_document(get_heads(), histroy, ops.iter(), ops.m.actors, ops.m.props._cache);
+    ensure_transaction_closed();
+
+    auto bytes = snapshot();
     saved = get_heads();
 
     return bytes;
 }
 
-void Automerge::filter_changes(const std::vector<ChangeHash>& _heads, std::set<ChangeHash>& changes) const {
+std::vector<u8> Automerge::snapshot() const {
+    auto& collected = ops.collected();
+    return encode_document(get_heads(), histroy, ops.iter(), collected, ops.len() + collected.size(),
+        ops.m.actors, ops.m.props._cache);
+}
+
+void Automerge::check_not_collected(const std::vector<ChangeHash>& heads) const {
+    if (gc_clock.clock.empty()) {
+        return;
+    }
+
+    auto res = clock_at(heads).cmp(gc_clock);
+    if (!res || (*res < 0)) {
+        throw AutomergeError{ AutomergeError::GarbageCollected };
+    }
+}
+
+usize Automerge::gc_before(const std::vector<ChangeHash>& heads) {
+    ensure_transaction_closed();
+
+    for (auto& hash : heads) {
+        if (!histroy_index->count(hash)) {
+            throw AutomergeError{ AutomergeError::MissingHash, hash };
+        }
+    }
+
+    auto clock = clock_at(heads);
+    gc_clock.merge(clock);
+    return ops.remove_if([&](const Op& op) {
+        if (op.succ.v.empty() || op.insert || (op.action.tag != OpType::Put) || op.is_counter()) {
+            return false;
+        }
+        return clock.covers(op.id) && std::all_of(op.succ.v.cbegin(), op.succ.v.cend(), [&](const OpId& id) {
+            return clock.covers(id);
+            });
+        });
+}
+
+usize Automerge::compact(const std::vector<ChangeHash>& heads) {
+    ensure_transaction_closed();
+
+    for (auto& hash : heads) {
+        if (!histroy_index->count(hash)) {
+            throw AutomergeError{ AutomergeError::MissingHash, hash };
+        }
+    }
+
+    // the ancestors of each actor are a prefix of its changes
+    auto clock = clock_at(heads);
+    usize count = 0;
+    for (usize actor_index = 0; actor_index < states->size(); ++actor_index) {
+        auto clock_data = clock.get_for_actor(actor_index);
+        if (!clock_data) {
+            continue;
+        }
+        for (usize seq = 0; seq < clock_data->seq; ++seq) {
+            usize position = (*states)[actor_index][seq];
+            if (!histroy[position].compacted) {
+                histroy.mut(position).drop_ops();
+                ++count;
+            }
+        }
+    }
+
+    return count;
+}
+
+std::vector<u8> Automerge::save_incremental() {
+    ensure_transaction_closed();
+
+    auto changes = get_changes(saved);
+    if (std::any_of(changes.cbegin(), changes.cend(), [](const Change* change) { return change->compacted; })) {
+        return save();
+    }
+
+    usize len = 0;
+    for (auto change : changes) {
+        len += change->bytes.raw().second;
+    }
+
+    std::vector<u8> bytes;
+    bytes.reserve(len);
+    for (auto change : changes) {
+        auto raw = change->bytes.raw();
+        bytes.insert(bytes.end(), raw.first, raw.first + raw.second);
+    }
+    saved = get_heads();
+
+    return bytes;
+}
+
+void Automerge::filter_changes(const std::vector<ChangeHash>& _heads, ChangeRanges& changes) const {
     std::vector<ChangeHash> heads;
     heads.reserve(_heads.size());
     for (auto& hash : _heads) {
-        if (histroy_index.count(hash)) {
+        if (histroy_index->count(hash)) {
             heads.push_back(hash);
         }
     }
+    if (heads.empty() || changes.empty()) {
+        return;
+    }
 
-    change_graph.remove_ancestors(changes, heads);
+    // the ancestors of the heads by an actor are its changes up to the clock
+    auto clock = clock_at(heads);
+    changes.remove_if([&](usize position) {
+        auto& change = histroy[position];
+        auto actor_index = ops.m.actors.lookup(change.actor_id());
+        auto clock_data = clock.get_for_actor(*actor_index);
+        return clock_data && (change.seq <= clock_data->seq);
+        });
 }
 
 std::vector<ChangeHash> Automerge::get_missing_deps(const std::vector<ChangeHash>& heads) const {
-    std::unordered_set<ChangeHash> in_queue;
-    for (auto& change : queue) {
-        in_queue.insert(change.hash);
-    }
-
-    // TODO: optimise, use pointer in set
     std::unordered_set<ChangeHash> missing;
-
-    for (auto& change : queue) {
-        for (auto& head : change.deps) {
-            if (!histroy_index.count(head)) {
-                missing.insert(head);
-            }
-        }
-    }
+    queue.missing_deps(missing);
 
     for (auto& head : heads) {
-        if (!histroy_index.count(head)) {
+        if (!histroy_index->count(head) && !queue.contains(head)) {
             missing.insert(head);
         }
     }
 
-    std::vector<ChangeHash> missing_deps;
-    missing_deps.reserve(missing.size());
-    for (auto iter = missing.begin(); iter != missing.end();) {
-        if (!in_queue.count(*iter)) {
-            // need iter++ as iter will be invalid after extract()
-            missing_deps.push_back(std::move(missing.extract(iter++).value()));
-        }
-        else {
-            ++iter;
-        }
-    }
+    std::vector<ChangeHash> missing_deps(missing.cbegin(), missing.cend());
     std::sort(missing_deps.begin(), missing_deps.end());
 
     return missing_deps;
@@ -434,29 +539,57 @@ std::vector<const Change*> Automerge::get_changes_clock(const std::vector<Change
     // get the clock for the given deps
     auto clock = clock_at(have_deps);
 
-    // get the documents current clock
-
-    std::vector<usize> change_indexes;
-    // walk the state from the given deps clock and add them into the vec
-    for (auto& [actor_index, actor_changes] : states) {
+    // the changes of each actor past the clock are a suffix of its changes
+    usize len = 0;
+    usize first = histroy.size();
+    for (usize actor_index = 0; actor_index < states->size(); ++actor_index) {
+        auto& actor_changes = (*states)[actor_index];
         auto clock_data = clock.get_for_actor(actor_index);
-        if (clock_data) {
-            // find the change in this actors sequence of changes that corresponds to the max_op
-            // recorded for them in the clock
-            change_indexes.insert(change_indexes.end(), actor_changes.begin() + clock_data->seq, actor_changes.end());
+        usize seq = clock_data ? clock_data->seq : 0;
+        if (seq < actor_changes.size()) {
+            len += actor_changes.size() - seq;
+            first = std::min(first, actor_changes[seq]);
         }
-        else {
-            vector_extend(change_indexes, actor_changes);
+    }
+
+    std::vector<const Change*> res;
+    res.reserve(len);
+    if (len == histroy.size() - first) {
+        for (usize i = first; i < histroy.size(); ++i) {
+            res.push_back(&histroy[i]);
         }
+        return res;
     }
 
-    // ensure the changes are still in sorted order
-    std::sort(change_indexes.begin(), change_indexes.end());
+    auto for_each_position = [&](auto&& f) {
+        for (usize actor_index = 0; actor_index < states->size(); ++actor_index) {
+            auto& actor_changes = (*states)[actor_index];
+            auto clock_data = clock.get_for_actor(actor_index);
+            for (usize i = clock_data ? clock_data->seq : 0; i < actor_changes.size(); ++i) {
+                f(actor_changes[i]);
+            }
+        }
+    };
 
-    std::vector<const Change*> res;
-    res.reserve(change_indexes.size());
-    for (auto i : change_indexes) {
-        res.push_back(&histroy[i]);
+    // a few changes spread over a long stretch of history are cheaper to sort
+    if ((histroy.size() - first) / 64 > len) {
+        std::vector<usize> positions;
+        positions.reserve(len);
+        for_each_position([&](usize pos) { positions.push_back(pos); });
+        std::sort(positions.begin(), positions.end());
+        for (auto pos : positions) {
+            res.push_back(&histroy[pos]);
+        }
+        return res;
+    }
+
+    // mark the positions from the first change to send, and collect them in history order
+    std::vector<bool> marks(histroy.size() - first, false);
+    for_each_position([&](usize pos) { marks[pos - first] = true; });
+    for (usize i = 0; i < marks.size(); ++i) {
+        if (marks[i]) {
+            res.push_back(&histroy[first + i]);
+        }
     }
 
     return res;
@@ -473,12 +606,12 @@ std::optional<Change> Automerge::get_last_local_change() const {
 }
 
 Clock Automerge::clock_at(const std::vector<ChangeHash>& heads) const {
-    return change_graph.clock_for_heads(heads);
+    return change_graph->clock_for_heads(heads);
 }
 
 std::optional<const Change*> Automerge::get_change_by_hash(const ChangeHash& hash) const {
     try {
-        auto index = histroy_index.at(hash);
+        auto index = histroy_index->at(hash);
         auto& change = histroy.at(index);
         return { &change };
     }
@@ -530,15 +663,10 @@ std::vector<ChangeHash> Automerge::get_heads() const {
 }
 
 ChangeHash Automerge::get_hash(usize actor, u64 seq) const {
-    try {
-        auto& state = states.at(actor);
-        auto& index = state.at(seq - 1);
-        auto& change = histroy.at(index);
-        return change.hash;
-    }
-    catch (std::out_of_range&) {
+    if ((actor >= states->size()) || (seq == 0) || (seq > (*states)[actor].size())) {
         throw AutomergeError{ AutomergeError::InvalidSeq, seq };
     }
+    return histroy[(*states)[actor][seq - 1]].hash;
 }
 
 usize Automerge::update_history(Change&& change, usize num_pos) {
@@ -549,10 +677,15 @@ usize Automerge::update_history(Change&& change, usize num_pos) {
     usize histroy_index = histroy.size();
 
     usize actor_index = ops.m.cache_actor(ActorId(change.actor_id()));
+    auto& states = this->states.mut();
+    if (actor_index >= states.size()) {
+        states.resize(actor_index + 1);
+    }
     states[actor_index].push_back(histroy_index);
 
-    this->histroy_index.insert({ change.hash, histroy_index });
-    change_graph.add_change(change, actor_index);
+    this->histroy_index.mut().insert({ change.hash, histroy_index });
+    change_graph.mut().add_change(change, actor_index);
+    queue.resolve(change.hash);
 
     histroy.push_back(std::move(change));
 
@@ -636,7 +769,45 @@ std::string Automerge::to_string(Export&& id) const {
 
 /////////////////////////////////////////////////////////
 
+// Whether a sync message of `count` changes is over the limits of `sync_state` if a change of
+// `bytes` total is added. A message takes at least one change, however large.
+static bool message_full(usize count, usize bytes, const State& sync_state) {
+    if (count == 0) {
+        return false;
+    }
+
+    return (sync_state.max_message_changes && count >= sync_state.max_message_changes) ||
+        (sync_state.max_message_bytes && bytes > sync_state.max_message_bytes);
+}
+
 std::optional<SyncMessage> Automerge::generate_sync_message(State& sync_state) const {
+    std::vector<const Change*> changes;
+    bool send_snapshot = false;
+    auto message = generate_sync_message(sync_state, [&](std::vector<ChangeHash>&& last_sync) {
+        if (sync_state.reconcile_sync) {
+            return make_sketch(std::move(last_sync), std::max(sync_state.their_wanted_cells(), sync_state.wanted_cells),
+                sync_state.blocked_bloom);
+        }
+        return make_bloom_filter(std::move(last_sync), sync_state.blocked_bloom);
+        }, changes, send_snapshot);
+    if (message) {
+        message->changes.reserve(changes.size());
+        for (auto change : changes) {
+            message->changes.push_back(*change);
+        }
+        if (send_snapshot) {
+            message->document = snapshot();
+        }
+    }
+
+    return message;
+}
+
+std::optional<SyncMessage> Automerge::generate_sync_message(State& sync_state,
+    const std::function<Have(std::vector<ChangeHash>&&)>& make_have, std::vector<const Change*>& changes,
+    bool& send_snapshot) const {
+    ensure_transaction_closed();
+
     auto our_heads = get_heads();
 
     auto our_need = get_missing_deps(sync_state.their_heads.value_or(std::vector<ChangeHash>()));
@@ -649,13 +820,6 @@ std::optional<SyncMessage> Automerge::generate_sync_message(State& sync_state) c
         }
     }
 
-    std::vector<Have> our_have;
-    if (std::all_of(our_need.cbegin(), our_need.cend(), [&](const ChangeHash& hash) {
-        return their_heads_set.count(hash);
-        })) {
-        our_have.push_back(make_bloom_filter(std::vector(sync_state.shared_heads)));
-    }
-
     if (sync_state.their_have.has_value() && !sync_state.their_have->empty()) {
         auto& last_sync = sync_state.their_have->front().last_sync;
         if (!std::all_of(last_sync.cbegin(), last_sync.cend(), [&](const ChangeHash& hash) {
@@ -670,23 +834,68 @@ std::optional<SyncMessage> Automerge::generate_sync_message(State& sync_state) c
         }
     }
 
+    bool heads_unchanged = sync_state.last_sent_heads == our_heads;
+
+    // carry on with the changes cut from the last message, rather than working them out again
+    bool streaming = heads_unchanged && !sync_state.unsent.empty();
+
     std::vector<const Change*> changes_to_send_p;
-    if (sync_state.their_have && sync_state.their_need) {
-        changes_to_send_p = get_changes_to_send(*sync_state.their_have, *sync_state.their_need);
-    }
+    if (streaming) {
+        // the changes the peer asks for go out next, ahead of the rest of the stream
+        if (sync_state.their_need) {
+            for (auto i = sync_state.their_need->rbegin(); i != sync_state.their_need->rend(); ++i) {
+                auto change = get_change_by_hash(*i);
+                if (change && !sync_state.sent_changes.contains(history_position(*change))) {
+                    auto& unsent = sync_state.unsent;
+                    unsent.erase(std::remove(unsent.begin(), unsent.end(), *i), unsent.end());
+                    unsent.push_back(*i);
+                }
+            }
+            sync_state.their_need->clear();
+        }
 
-    bool heads_unchanged = sync_state.last_sent_heads == our_heads;
+        usize bytes = 0;
+        while (!sync_state.unsent.empty()) {
+            auto change = get_change_by_hash(sync_state.unsent.back());
+            if (change) {
+                bytes += (*change)->bytes.raw().second;
+                if (message_full(changes_to_send_p.size(), bytes, sync_state)) {
+                    break;
+                }
+                changes_to_send_p.push_back(*change);
+            }
+            sync_state.unsent.pop_back();
+        }
+    }
+    else if (sync_state.their_have && sync_state.their_need) {
+        changes_to_send_p = get_changes_to_send(*sync_state.their_have, *sync_state.their_need,
+            &sync_state.wanted_cells);
+    }
 
     bool heads_equal = false;
     if (sync_state.their_heads) {
         heads_equal = *sync_state.their_heads == our_heads;
     }
 
-    // deduplicate the changes to send with those we have already sent and clone it now
-    std::vector<Change> changes_to_send;
-    for (auto& change : changes_to_send_p) {
-        if (!sync_state.sent_hashes.count(change->hash)) {
-            changes_to_send.push_back(*change);
+    // compacted changes cannot be sent, the peer needs a snapshot instead
+    bool asked_for_snapshot = sync_state.needs_snapshot;
+    bool compacted = std::any_of(changes_to_send_p.cbegin(), changes_to_send_p.cend(),
+        [](const Change* change) { return change->compacted; });
+    sync_state.needs_snapshot = compacted && !sync_state.snapshot_sync;
+    if (sync_state.needs_snapshot) {
+        sync_state.unsent.clear();
+        // until the peer has the snapshot, further messages would go round in circles
+        if (asked_for_snapshot) {
+            return {};
+        }
+        changes_to_send_p.clear();
+    }
+
+    // deduplicate the changes to send with those we have already sent
+    std::vector<const Change*> changes_to_send;
+    for (auto change : changes_to_send_p) {
+        if (!sync_state.sent_changes.contains(history_position(change))) {
+            changes_to_send.push_back(change);
         }
     }
 
@@ -694,30 +903,72 @@ std::optional<SyncMessage> Automerge::generate_sync_message(State& sync_state) c
         if (heads_equal&& changes_to_send.empty()) {
             return {};
         }
-        if (sync_state.in_flight) {
+        // the rest of a cut short message goes out without waiting for the peer
+        if (sync_state.in_flight && !(streaming && !changes_to_send.empty())) {
             return {};
         }
     }
 
+    send_snapshot = sync_state.snapshot_sync && !changes_to_send.empty() && (compacted ||
+        ((histroy.size() >= SNAPSHOT_MIN_CHANGES) && (changes_to_send.size() * 2 >= histroy.size())));
+    if (send_snapshot) {
+        sync_state.unsent.clear();
+    }
+    else if (!streaming) {
+        // cut the changes to the limits, keeping the rest for the following messages
+        usize fit = 0;
+        usize bytes = 0;
+        for (; fit < changes_to_send.size(); ++fit) {
+            bytes += changes_to_send[fit]->bytes.raw().second;
+            if (message_full(fit, bytes, sync_state)) {
+                break;
+            }
+        }
+        sync_state.unsent.clear();
+        for (usize i = changes_to_send.size(); i > fit; --i) {
+            sync_state.unsent.push_back(changes_to_send[i - 1]->hash);
+        }
+        changes_to_send.resize(fit);
+    }
+
     sync_state.last_sent_heads = our_heads;
-    for (auto& c : changes_to_send) {
-        sync_state.sent_hashes.insert(c.hash);
+    for (auto c : changes_to_send) {
+        sync_state.sent_changes.insert(history_position(c));
     }
 
     sync_state.in_flight = true;
+    if (!send_snapshot) {
+        changes = std::move(changes_to_send);
+    }
+
+    // made last, so that a sketch of ours is as large as a difference just found too large for the
+    // peer's, which the peer then decodes, and asks the peer for as large a sketch
+    std::vector<Have> our_have;
+    if (std::all_of(our_need.cbegin(), our_need.cend(), [&](const ChangeHash& hash) {
+        return their_heads_set.count(hash);
+        })) {
+        our_have.push_back(make_have(std::vector(sync_state.shared_heads)));
+        our_have.back().sketch.wanted_cells = sync_state.wanted_cells;
+    }
 
     return SyncMessage{
         std::move(our_heads),
         std::move(our_need),
         std::move(our_have),
-        std::move(changes_to_send)
+        {}
     };
 }
 
 void Automerge::receive_sync_message_with(State& sync_state, SyncMessage&& message, OpObserver* options) {
+    ensure_transaction_closed();
+
     auto before_heads = get_heads();
 
-    auto& [message_heads, message_need, message_have, message_changes] = message;
+    auto& [message_heads, message_need, message_have, message_changes, message_document] = message;
+    if (!message_document.empty()) {
+        // the changes of a snapshot are applied with those sent one by one
+        vector_extend(message_changes, Change::load_blocks(make_bin_slice(message_document)));
+    }
 
     bool change_is_empty = message_changes.empty();
     if (!change_is_empty) {
@@ -731,13 +982,13 @@ void Automerge::receive_sync_message_with(State& sync_state, SyncMessage&& messa
     }
 
     // trim down the sent hashes to those that we know they haven't seen
-    filter_changes(message_heads, sync_state.sent_hashes);
+    filter_changes(message_heads, sync_state.sent_changes);
 
     if (change_is_empty && (message_heads == before_heads)) {
         sync_state.last_sent_heads = message_heads;
     }
 
-    if (sync_state.sent_hashes.empty()) {
+    if (sync_state.sent_changes.empty()) {
         sync_state.in_flight = false;
     }
 
@@ -754,7 +1005,8 @@ void Automerge::receive_sync_message_with(State& sync_state, SyncMessage&& messa
         // If the remote peer has lost all its data, reset our state to perform a full resync
         if (message_heads.empty()) {
             sync_state.last_sent_heads.clear();
-            sync_state.sent_hashes.clear();
+            sync_state.sent_changes.clear();
+            sync_state.unsent.clear();
         }
     }
     else {
@@ -768,6 +1020,8 @@ void Automerge::receive_sync_message_with(State& sync_state, SyncMessage&& messa
 
         auto last = std::unique(shared.begin(), shared.end());
         shared.erase(last, shared.end());
+        // keep the shared heads from growing with every message
+        change_graph->remove_redundant_heads(shared);
     }
 
     sync_state.their_have = std::move(message_have);
@@ -777,7 +1031,7 @@ void Automerge::receive_sync_message_with(State& sync_state, SyncMessage&& messa
     return;
 }
 
-Have Automerge::make_bloom_filter(std::vector<ChangeHash>&& last_sync) const {
+Have Automerge::make_bloom_filter(std::vector<ChangeHash>&& last_sync, bool blocked) const {
     auto new_changes = get_changes(last_sync);
     
     std::vector<const ChangeHash*> hashes;
@@ -788,14 +1042,43 @@ Have Automerge::make_bloom_filter(std::vector<ChangeHash>&& last_sync) const {
 
     return Have {
         std::move(last_sync),
-        BloomFilter(std::move(hashes))
+        BloomFilter(std::move(hashes), blocked)
     };
 }
 
-std::vector<const Change*> Automerge::get_changes_to_send(const std::vector<Have>& have, const std::vector<ChangeHash>& need) const {
+Have Automerge::make_sketch(std::vector<ChangeHash>&& last_sync, usize min_cells, bool blocked) const {
+    auto new_changes = get_changes(last_sync);
+
+    std::vector<const ChangeHash*> hashes;
+    hashes.reserve(new_changes.size());
+    for (auto change : new_changes) {
+        hashes.push_back(&change->hash);
+    }
+
+    // the table starts small, the peer asks for a larger one if the difference turns out larger
+    usize num_cells = std::max(IBLT_MIN_CELLS, min_cells);
+    if (num_cells >= BloomFilter::bits_capacity((u32)hashes.size(), BITS_PER_ENTRY, blocked) / IBLT_CELL_BYTES) {
+        return Have{
+            std::move(last_sync),
+            BloomFilter(std::move(hashes), blocked)
+        };
+    }
+
+    return Have{
+        std::move(last_sync),
+        BloomFilter(),
+        Iblt(hashes, num_cells)
+    };
+}
+
+std::vector<const Change*> Automerge::get_changes_to_send(const std::vector<Have>& have, const std::vector<ChangeHash>& need,
+    usize* wanted_cells) const {
     std::vector<const Change*> changes_to_send;
+    if (wanted_cells) {
+        *wanted_cells = 0;
+    }
 
-    if (have.empty()) {
+    auto needed_changes = [&]() {
         for (auto& hash : need) {
             auto change = get_change_by_hash(hash);
             if (change) {
@@ -804,6 +1087,10 @@ std::vector<const Change*> Automerge::get_changes_to_send(const std::vector<Have
         }
 
         return changes_to_send;
+    };
+
+    if (have.empty()) {
+        return needed_changes();
     }
 
     // TODO: optimise, use pointer in set
@@ -812,9 +1099,10 @@ std::vector<const Change*> Automerge::get_changes_to_send(const std::vector<Have
     bloom_filters.reserve(have.size());
 
     for (auto& h : have) {
-        auto& [last_sync, bloom] = h;
-        last_sync_hashes_set.insert(last_sync.cbegin(), last_sync.cend());
-        bloom_filters.push_back(&bloom);
+        last_sync_hashes_set.insert(h.last_sync.cbegin(), h.last_sync.cend());
+        if (h.sketch.empty()) {
+            bloom_filters.push_back(&h.bloom);
+        }
     }
 
     std::vector<ChangeHash> last_sync_hashes;
@@ -830,16 +1118,87 @@ std::vector<const Change*> Automerge::get_changes_to_send(const std::vector<Have
     std::unordered_map<ChangeHash, std::vector<ChangeHash>> dependents;
     std::unordered_set<ChangeHash> hashes_to_send;
 
+    // a change goes if no filter has it
+    std::vector<const ChangeHash*> hashes;
+    hashes.reserve(changes.size());
     for (auto change : changes) {
+        hashes.push_back(&change->hash);
+    }
+    std::vector<bool> in_bloom(changes.size(), false);
+    for (auto bloom : bloom_filters) {
+        auto contained = bloom->contains_many(hashes);
+        for (usize i = 0; i < changes.size(); ++i) {
+            if (contained[i]) {
+                in_bloom[i] = true;
+            }
+        }
+    }
+
+    // a sketch has every change but those its difference from ours finds only we have
+    bool decoded = true;
+    for (auto& h : have) {
+        if (h.sketch.empty()) {
+            continue;
+        }
+
+        std::vector<const Change*> own_changes;
+        if (have.size() > 1) {
+            own_changes = get_changes(h.last_sync);
+        }
+        auto& since = (have.size() > 1) ? own_changes : changes;
+        std::vector<const ChangeHash*> since_hashes;
+        since_hashes.reserve(since.size());
+        for (auto change : since) {
+            since_hashes.push_back(&change->hash);
+        }
+
+        // the keys peeled as ours must each be one of our changes, and no two of our changes may
+        // share a key, or the table cannot tell the changes apart
+        std::unordered_set<u64> since_keys;
+        since_keys.reserve(since.size());
+        bool distinct = std::all_of(since.cbegin(), since.cend(), [&](const Change* change) {
+            return since_keys.insert(Iblt::key(change->hash)).second;
+            });
+
+        std::vector<u64> ours;
+        std::vector<u64> theirs;
+        Iblt own_sketch(since_hashes, h.sketch.cells.size());
+        if (!distinct || !own_sketch.difference(h.sketch, ours, theirs) ||
+            !std::all_of(ours.cbegin(), ours.cend(), [&](u64 key) { return since_keys.count(key) > 0; })) {
+            // sized for twice the estimated difference, which is at most every change either of
+            // us has since the last sync
+            if (wanted_cells) {
+                usize most = (usize)h.sketch.num_entries + since.size();
+                usize estimate = own_sketch.estimate_difference(h.sketch);
+                estimate = (estimate > most / 2) ? most : 2 * estimate;
+                *wanted_cells = std::max({ *wanted_cells, Iblt::cells_for(estimate), 2 * h.sketch.cells.size() });
+            }
+            decoded = false;
+            continue;
+        }
+
+        std::unordered_set<u64> missing(ours.cbegin(), ours.cend());
+        for (usize i = 0; i < changes.size(); ++i) {
+            if (!missing.count(Iblt::key(changes[i]->hash))) {
+                in_bloom[i] = true;
+            }
+        }
+    }
+    // the rest of what the peer lacks is found by the larger sketch asked for, or by the bloom
+    // filter the peer sends instead once that is smaller, see `make_sketch`
+    if (!decoded) {
+        return needed_changes();
+    }
+
+    for (usize i = 0; i < changes.size(); ++i) {
+        auto change = changes[i];
         change_hashes.insert(change->hash);
 
         for (auto& dep : change->deps) {
             dependents[dep].push_back(change->hash);
         }
 
-        if (std::all_of(bloom_filters.cbegin(), bloom_filters.cend(), [&](const BloomFilter* bloom) {
-            return !bloom->contains_hash(change->hash);
-            })) {
+        if (!in_bloom[i]) {
             hashes_to_send.insert(change->hash);
         }
     }
@@ -1323,13 +1682,13 @@ void Automerge::json_add(const json::json_pointer& path, const json& value) {
     // update json doc
     if (item_data.second.tag == Prop::Seq) {
         // add an item into an array of json
-        auto& parent_ref = json_doc[path.parent_pointer()];
+        auto& parent_ref = json_mut()[path.parent_pointer()];
         auto index = std::stoi(path.back());
         parent_ref.insert(parent_ref.begin() + index, value);
     }
     else {
         // add an item into a map of json
-        json_doc[path] = value;
+        json_mut()[path] = value;
     }
 }
 
@@ -1401,7 +1760,7 @@ void Automerge::json_replace(const json::json_pointer& path, const json& value)
     json_replacing(prop_pair, std::move(*parsed_value));
 
     // update json doc
-    auto& item_ref = json_doc[path];
+    auto& item_ref = json_mut()[path];
     item_ref = value;
 }
 
@@ -1450,7 +1809,7 @@ void Automerge::json_delete(const json::json_pointer& path) {
 
     // update json doc
     try {
-        auto& parent_ref = json_doc.at(path.parent_pointer());
+        auto& parent_ref = json_mut().at(path.parent_pointer());
         if (prop.tag == Prop::Seq) {
             // delete an item from an array of json
             auto index = std::stoi(path.back());
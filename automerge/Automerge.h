@@ -11,14 +11,18 @@
 #include <utility>
 #include <optional>
 #include <algorithm>
+#include <chrono>
+#include <functional>
 
 #include "type.h"
 #include "Change.h"
+#include "History.h"
 #include "ExId.h"
 #include "OpSet.h"
 #include "Keys.h"
 #include "transaction/Transaction.h"
 #include "ChangeGraph.h"
+#include "CausalQueue.h"
 #include "transaction/CommitOptions.h"
 #include "Sync.h"
 #include "Error.h"
@@ -37,20 +41,24 @@ using TransactionFunc = std::function<std::vector<ExId>(Transaction&)>;
 using CommitOptionsFunc = std::function<CommitOptions<OpObserver>(const std::vector<ExId>&)>;
 
 struct Automerge {
-    // The list of unapplied changes that are not causally ready.
-    std::vector<Change> queue;
+    // The unapplied changes that are not causally ready.
+    CausalQueue queue;
     // The history of changes that form this document, topologically sorted too.
-    std::vector<Change> histroy;
+    History histroy;
     // Mapping from change hash to index into the history list.
-    std::unordered_map<ChangeHash, usize> histroy_index;
+    CopyOnWrite<std::unordered_map<ChangeHash, usize>> histroy_index;
     // Graph of changes
-    ChangeGraph change_graph;
-    // Mapping from actor index to list of seqs seen for them.
-    std::unordered_map<usize, VecPos> states;
+    CopyOnWrite<ChangeGraph> change_graph;
+    // Mapping from actor index to the history positions of its changes, in seq order.
+    CopyOnWrite<std::vector<VecPos>> states;
     // Current dependencies of this document (heads hashes).
     std::unordered_set<ChangeHash> deps;
     // Heads at the last save.
     std::vector<ChangeHash> saved;
+    // The leading bytes of a chunk `load_incremental` has only received part of.
+    std::vector<u8> incremental_tail;
+    // The changes whose tombstones `gc_before` has removed from the op set.
+    Clock gc_clock;
     // The set of operations that form this document.
     OpSet ops;
     // The current actor.
@@ -58,7 +66,7 @@ struct Automerge {
     // The maximum operation counter this document has seen.
     u64 max_op;
 
-    Automerge() : queue(), histroy(), histroy_index(), change_graph(), states(), deps(), saved(), ops(),
+    Automerge() : queue(), histroy(), histroy_index(), change_graph(), states(), deps(), saved(), incremental_tail(), gc_clock(), ops(),
         actor{ false, ActorId(true), 0 }, max_op(0) {}
 
     // Set the actor id for this document.
@@ -91,7 +99,15 @@ struct Automerge {
 
     // Fork this document at the current point for use by a different actor.
     // This will create a new actor ID for the forked document
+    // The fork shares the op trees, the history and the json with this document, so forking does
+    // not depend on the size of the document. A write copies only the op tree nodes on its path, and
+    // a commit appends to the shared history; only the history index, the change graph and the
+    // change positions of each actor are copied whole, on the first commit after the fork.
+    // As they share state, the fork and this document must not be used on different threads at the
+    // same time while either is changed; hand another thread a `load` of `save` instead.
     Automerge fork() const {
+        ensure_transaction_closed();
+
         Automerge f = *this;
         f.set_actor(ActorId(true));
 
@@ -137,6 +153,7 @@ struct Automerge {
     usize length(const ExId& obj) const;
 
     // Historical version of [`length`](Self::length).
+    // throw AutomergeError if `gc_before` has removed ops the heads still see
     usize length_at(const ExId& obj, const std::vector<ChangeHash>& heads) const;
 
     // Get the type of this object, if it is an object.
@@ -180,7 +197,37 @@ struct Automerge {
     // throw exception
     static Automerge load_with(const BinSlice& data, OpObserver* options);
 
-    // load_incremental, load_incremental_with
+    // Load a document from a buffer it takes shared ownership of. Changes stored as change chunks
+    // reference their bytes in `data` rather than copying them, so the buffer is kept alive for as
+    // long as the document or any of its changes.
+    // throw exception
+    static Automerge load_shared(const SharedBytes& data) {
+        return load_shared_with(data, nullptr);
+    }
+
+    // throw exception
+    static Automerge load_shared_with(const SharedBytes& data, OpObserver* options);
+
+    // Read the file at `path` into a single shared buffer and load it with `load_shared`.
+    // throw exception
+    static Automerge load_file(const std::string& path);
+
+    // Apply the changes in `data`, a sequence of change and document chunks, that this document
+    // does not have yet. Returns the number of ops added.
+    // `data` may end partway through a chunk. The bytes of that chunk are kept and completed by the
+    // next call, so a file or a stream can be fed as it is read.
+    // throw exception
+    usize load_incremental(const BinSlice& data) {
+        return load_incremental_with(data, nullptr);
+    }
+
+    // throw exception
+    usize load_incremental_with(const BinSlice& data, OpObserver* options);
+
+    // The number of bytes of an incomplete chunk waiting for the next `load_incremental`.
+    usize pending_incremental_bytes() const {
+        return incremental_tail.size();
+    }
 
     bool duplicate_seq(const Change& change) const;
 
@@ -210,12 +257,45 @@ struct Automerge {
 
     std::vector<u8> save();
 
-    // save_incremental
+    // The document as one document chunk, what `save` returns, without marking it saved.
+    std::vector<u8> snapshot() const;
+
+    // Drop the encoded ops of `heads` and their ancestors from the history. Only the metadata of
+    // those changes is kept, which is all a document chunk needs besides the op set, so `save` and
+    // `snapshot` are unaffected, while sending the changes one by one is no longer possible:
+    // `merge`, `save_incremental` and sync fall back to a snapshot for a peer that lacks them, see
+    // `State::needs_snapshot`. Returns the number of changes compacted.
+    // throw AutomergeError
+    usize compact(const std::vector<ChangeHash>& heads);
+
+    // Remove the tombstones that every peer has seen, the overwritten and deleted map values and
+    // list values that `heads` and their ancestors cover, from the op set, so that queries no
+    // longer step over them. `heads` must be causally stable: every peer has them, so no change
+    // still to come can refer to a removed op. Counters, objects and list elements themselves are
+    // kept, since later ops still count, reach or position against them.
+    // The collection is in memory only: the removed ops are set aside in the op set rather than
+    // freed, and `save` and `snapshot` encode them with the rest, so the document chunk is the
+    // same as without the collection and `load` brings the tombstones back. This also leaves
+    // `compact` free to run before or after. Historical reads at heads that do not cover every
+    // collected change throw `AutomergeError::GarbageCollected` instead of reading a document
+    // with the tombstones missing. Returns the number of ops removed.
+    // throw AutomergeError
+    usize gc_before(const std::vector<ChangeHash>& heads);
+
+    // Save the changes since the last `save` or `save_incremental` as concatenated change chunks.
+    // Appending the result to the previously saved bytes gives a buffer `load` accepts.
+    // If some of the changes are compacted, the result is a snapshot instead.
+    std::vector<u8> save_incremental();
         
     // Filter the changes down to those that are not transitive dependencies of the heads.
     // Thus a graph with these heads has not seen the remaining changes.
     // throw AutomergeError
-    void filter_changes(const std::vector<ChangeHash>& heads, std::set<ChangeHash>& changes) const;
+    void filter_changes(const std::vector<ChangeHash>& heads, ChangeRanges& changes) const;
+
+    // The position in the history of `change`, which is one of its changes.
+    usize history_position(const Change* change) const {
+        return histroy_index->at(change->hash);
+    }
 
     // Get the hashes of the changes in this document that aren't transitive dependencies of the
     // given `heads`.
@@ -262,13 +342,21 @@ struct Automerge {
     std::string to_string(Export&& id) const;
 
     std::string dump(const u8 indent = 0) const {
-        return json_doc.dump(indent);
+        return json_doc->dump(indent);
     }
 
     // visualise_optree
 
     std::optional<SyncMessage> generate_sync_message(State& sync_state) const;
 
+    // `generate_sync_message` with the per-document work left to the caller, see `SyncHub`:
+    // `make_have` builds the bloom filter of the changes since the given heads, the changes to
+    // send are pointed to by `changes` instead of being copied into the message, and
+    // `send_snapshot` is set if the message is to carry a `snapshot` instead.
+    std::optional<SyncMessage> generate_sync_message(State& sync_state,
+        const std::function<Have(std::vector<ChangeHash>&&)>& make_have, std::vector<const Change*>& changes,
+        bool& send_snapshot) const;
+
     // throw
     void receive_sync_message(State& sync_state, SyncMessage&& message) {
         receive_sync_message_with(sync_state, std::move(message), nullptr);
@@ -277,10 +365,19 @@ struct Automerge {
     // throw
     void receive_sync_message_with(State& sync_state, SyncMessage&& message, OpObserver *options);
 
-    Have make_bloom_filter(std::vector<ChangeHash>&& last_sync) const;
+    // A `blocked` filter is faster to query, see `BloomFilter::blocked`.
+    Have make_bloom_filter(std::vector<ChangeHash>&& last_sync, bool blocked = false) const;
+
+    // An `Iblt` of the changes since `last_sync`, of at least `min_cells` cells, see
+    // `State::reconcile_sync`. Falls back to `make_bloom_filter` where the filter is smaller.
+    Have make_sketch(std::vector<ChangeHash>&& last_sync, usize min_cells, bool blocked = false) const;
 
+    // The changes a peer lacks by its `have` and `need`. A sketch of the peer that is too small
+    // to decode, or whose keys collide, leaves only the `need` changes to send, and sets
+    // `wanted_cells` to the size to ask the peer for instead.
     // throw
-    std::vector<const Change*> get_changes_to_send(const std::vector<Have>& have, const std::vector<ChangeHash>& need) const;
+    std::vector<const Change*> get_changes_to_send(const std::vector<Have>& have, const std::vector<ChangeHash>& need,
+        usize* wanted_cells = nullptr) const;
 
     // autocommit.rs, wasm/lib.rs: put
     // throw AutomergeError
@@ -376,6 +473,32 @@ struct Automerge {
           after all add/replace/delete operations applied of one user operation.
     */
     void commit() {
+        if (_transaction && !coalescing()) {
+            flush();
+        }
+    }
+
+    /*!
+    @brief coalesce successive commit() calls into one change
+    @param[in] max_ops      commit() ends the change once it holds at least this many ops, 0 turns
+                            coalescing off
+    @param[in] max_delay    commit() ends the change once this much time passed since its first op
+
+    @note A coalesced change is hashed, encoded and added to the history once, however many commits
+          it holds. Until then its ops are in the document, but not in get_heads() or get_changes(),
+          so call flush() when the editor goes idle. Saving, syncing, applying or merging changes,
+          loading, compacting and forking commit the coalesced change first, so remote changes
+          never interleave with an open change.
+    */
+    void set_group_commit(usize max_ops, std::chrono::milliseconds max_delay = std::chrono::milliseconds::max()) {
+        group_commit_max_ops = max_ops;
+        group_commit_max_delay = max_delay;
+    }
+
+    /*!
+    @brief commit the pending operations now, including the commits being coalesced
+    */
+    void flush() {
         if (_transaction) {
             _transaction->commit();
             _transaction.reset();
@@ -387,20 +510,56 @@ struct Automerge {
     @return a const reference of the json object
     */
     const json& json_const_ref() const {
-        return json_doc;
+        return *json_doc;
     }
 
 private:
     // json object of the whole doc, updated by every operation, always equals to the result of to_json()
-    json json_doc;
+    // A fork shares it until either document writes to it.
+    std::shared_ptr<json> json_doc = std::make_shared<json>();
     std::optional<Transaction> _transaction = {};
+    // commit() coalesces commits while the open transaction is below both limits
+    usize group_commit_max_ops = 0;
+    std::chrono::milliseconds group_commit_max_delay = std::chrono::milliseconds::max();
+    std::chrono::steady_clock::time_point transaction_start = {};
+
+    // Unshare the json object before writing to it, like `make_mut` for the op tree nodes.
+    json& json_mut() {
+        if (json_doc.use_count() > 1) {
+            json_doc = std::make_shared<json>(*json_doc);
+        }
+        return *json_doc;
+    }
+
+    // throw AutomergeError if `heads` do not cover the changes `gc_before` has collected
+    void check_not_collected(const std::vector<ChangeHash>& heads) const;
+
+    // Commit the transaction that commit() is coalescing, so that whatever reads or changes the
+    // document next sees its ops in the history, and a later transaction starts from the current
+    // heads. A plain open transaction is left to the caller, as without group commit.
+    // The ops of the coalesced change are in the document already, committing it only adds it to
+    // the history, so readers such as `fork` and `generate_sync_message` stay const.
+    void ensure_transaction_closed() const {
+        if (_transaction && coalescing()) {
+            const_cast<Automerge*>(this)->flush();
+        }
+    }
 
     void ensure_transaction_open() {
         if (!_transaction.has_value()) {
             _transaction = transaction();
+            if (group_commit_max_ops) {
+                transaction_start = std::chrono::steady_clock::now();
+            }
         }
     }
 
+    bool coalescing() const {
+        return (_transaction->inner->pending_ops() < group_commit_max_ops) &&
+            (std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - transaction_start) <
+                group_commit_max_delay);
+    }
+
     ExId json_adding(const PropPair& item, std::pair<Value, std::list<std::pair<Prop, json>>>&& value);
     ExId json_replacing(const PropPair& item, std::pair<Value, std::list<std::pair<Prop, json>>>&& value);
 
@@ -0,0 +1,74 @@
+// Copyright (c) 2022 the VGG Automerge contributors
+// This code is licensed under MIT license (see LICENSE for details)
+
+#include "CausalQueue.h"
+#include "helper.h"
+
+void CausalQueue::push(Change&& change, const std::vector<ChangeHash>& missing) {
+    if (index.count(change.hash)) {
+        return;
+    }
+
+    usize slot = entries.size();
+    if (free_entries.empty()) {
+        entries.emplace_back();
+    }
+    else {
+        slot = vector_pop(free_entries);
+    }
+
+    auto& entry = entries[slot];
+    entry.missing = 0;
+    for (auto& dep : missing) {
+        auto& waiters = waiting[dep];
+        // a dep listed twice is waited for once
+        if (waiters.empty() || waiters.back() != slot) {
+            waiters.push_back(slot);
+            ++entry.missing;
+        }
+    }
+    if (entry.missing == 0) {
+        ready.push_back(slot);
+    }
+
+    index.emplace(change.hash, slot);
+    entry.change = std::move(change);
+}
+
+void CausalQueue::resolve(const ChangeHash& hash) {
+    auto found = waiting.find(hash);
+    if (found == waiting.end()) {
+        return;
+    }
+
+    for (auto slot : found->second) {
+        if (--entries[slot].missing == 0) {
+            ready.push_back(slot);
+        }
+    }
+    waiting.erase(found);
+}
+
+std::optional<Change> CausalQueue::pop_ready() {
+    if (ready.empty()) {
+        return {};
+    }
+
+    usize slot = vector_pop(ready);
+    auto& entry = entries[slot];
+    std::optional<Change> change = std::move(entry.change);
+    entry.change.reset();
+
+    index.erase(change->hash);
+    free_entries.push_back(slot);
+
+    return change;
+}
+
+void CausalQueue::missing_deps(std::unordered_set<ChangeHash>& missing) const {
+    for (auto& [dep, _] : waiting) {
+        if (!index.count(dep)) {
+            missing.insert(dep);
+        }
+    }
+}
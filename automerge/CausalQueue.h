@@ -0,0 +1,61 @@
+// Copyright (c) 2022 the VGG Automerge contributors
+// This code is licensed under MIT license (see LICENSE for details)
+
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <optional>
+
+#include "type.h"
+#include "Change.h"
+
+// The changes that are not causally ready yet, indexed by the dependencies they wait for.
+// Each queued change counts its unapplied deps. Applying a change only visits the changes waiting
+// for it, so a burst of N changes arriving out of order is scheduled with O(N) hash lookups rather
+// than a rescan of the whole queue after every applied change.
+class CausalQueue {
+public:
+    bool empty() const {
+        return index.empty();
+    }
+
+    usize size() const {
+        return index.size();
+    }
+
+    bool contains(const ChangeHash& hash) const {
+        return index.count(hash);
+    }
+
+    // Queue `change`, which waits for the `missing` deps. A change that is already queued is ignored.
+    void push(Change&& change, const std::vector<ChangeHash>& missing);
+
+    // Record that the change `hash` has been applied. The changes that waited only for it become
+    // ready.
+    void resolve(const ChangeHash& hash);
+
+    // Take a queued change whose deps have all been applied.
+    std::optional<Change> pop_ready();
+
+    // Add the deps that queued changes wait for and that are not queued themselves to `missing`.
+    void missing_deps(std::unordered_set<ChangeHash>& missing) const;
+
+private:
+    struct Entry {
+        std::optional<Change> change;
+        // the number of deps not applied yet
+        usize missing = 0;
+    };
+
+    // Slots of queued changes, the slots of popped changes are reused.
+    std::vector<Entry> entries;
+    std::vector<usize> free_entries;
+    // Mapping from the hash of a queued change to its slot.
+    std::unordered_map<ChangeHash, usize> index;
+    // Mapping from an unapplied dep to the slots of the changes waiting for it.
+    std::unordered_map<ChangeHash, std::vector<usize>> waiting;
+    // Slots of the changes with all deps applied.
+    std::vector<usize> ready;
+};
@@ -8,34 +8,28 @@
 
 #include "Change.h"
 #include "Columnar.h"
+#include "History.h"
 #include "helper.h"
+#include "leb128.h"
 #include "picosha2.h"
 
-std::vector<u8> encode_document(std::vector<ChangeHash>&& heads, const std::vector<Change>& changes,
-    OpSetIter&& doc_ops, const IndexedCache<ActorId>& actors_index, const std::vector<std::string_view>& props)
+std::vector<u8> encode_document(std::vector<ChangeHash>&& heads, const History& changes,
+    OpSetIter&& doc_ops, const std::vector<std::pair<ObjId, Op>>& collected, usize num_ops,
+    const IndexedCache<ActorId>& actors_index, const std::vector<std::string_view>& props)
 {
     auto actors_map = actors_index.encode_index();
     auto actors = actors_index.sorted();
 
-    auto [change_bytes, change_info] = ChangeEncoder::encode_changes(changes, actors);
+    auto change_cols = ChangeEncoder::encode_changes(changes, actors);
 
-    auto [ops_bytes, ops_info] = DocOpEncoder::encode_doc_ops(doc_ops, actors_map, props);
+    auto ops_cols = DocOpEncoder::encode_doc_ops(doc_ops, collected, actors_map, props, num_ops);
 
-    std::vector<u8> actors_num_bytes;
-    Encoder actors_num_bytes_encoder(actors_num_bytes);
-    actors_num_bytes.reserve(LEB128_U64_MAX_BYTE_SIZE);
-    actors_num_bytes_encoder.encode(actors.len());
-
-    std::vector<u8> heads_num_bytes;
-    Encoder heads_num_bytes_encoder(heads_num_bytes);
-    heads_num_bytes.reserve(LEB128_U64_MAX_BYTE_SIZE);
-    heads_num_bytes_encoder.encode(heads.size());
-
-    usize chunk_size = actors_num_bytes.size() + actors.len() * (1 + ACTOR_ID_SIZE) +
-        heads_num_bytes.size() + heads.size() * HASH_SIZE +
-        change_info.size() + ops_info.size() + change_bytes.size() + ops_bytes.size();
+    usize chunk_size = unsigned_leb128_len(actors.len()) + actors.len() * (1 + ACTOR_ID_SIZE) +
+        unsigned_leb128_len(heads.size()) + heads.size() * HASH_SIZE +
+        change_cols.info_len() + ops_cols.info_len() + change_cols.data_len() + ops_cols.data_len();
     usize bytes_reserve_size = HEADER_BYTES + LEB128_U64_MAX_BYTE_SIZE + chunk_size;
 
+    // the chunk is allocated once, the columns are copied into it from their encoders
     std::vector<u8> bytes;
     Encoder bytes_encoder(bytes);
     bytes.reserve(bytes_reserve_size);
@@ -45,21 +39,21 @@ std::vector<u8> encode_document(std::vector<ChangeHash>&& heads, const std::vect
     bytes.push_back(BLOCK_TYPE_DOC);
     bytes_encoder.encode(chunk_size);
 
-    vector_extend(bytes, std::move(actors_num_bytes));
+    bytes_encoder.encode(actors.len());
     for (auto& a : actors._cache) {
         bytes_encoder.encode(a);
     }
 
-    vector_extend(bytes, std::move(heads_num_bytes));
+    bytes_encoder.encode(heads.size());
     for (auto& head : heads) {
         std::move(std::begin(head.data), std::end(head.data), std::back_inserter(bytes));
     }
 
-    vector_extend(bytes, std::move(change_info));
-    vector_extend(bytes, std::move(ops_info));
+    change_cols.write_info(bytes_encoder);
+    ops_cols.write_info(bytes_encoder);
 
-    vector_extend(bytes, std::move(change_bytes));
-    vector_extend(bytes, std::move(ops_bytes));
+    change_cols.write_data(bytes);
+    ops_cols.write_data(bytes);
 
     std::vector<u8> hash_result(picosha2::k_digest_size);
     picosha2::hash256(bytes.begin() + CHUNK_START, bytes.end(), hash_result.begin(), hash_result.end());
@@ -77,17 +71,18 @@ void ChangeBytes::compress(usize body_start) {
         return;
     }
     
-    if (uncompressed.size() <= DEFLATE_MIN_SIZE) {
+    auto uncompressed = get_uncompressed();
+    if (uncompressed.second <= DEFLATE_MIN_SIZE) {
         return;
     }
 
-    auto deflated = deflate_compress({ uncompressed.cbegin() + body_start, uncompressed.size() - body_start });
+    auto deflated = deflate_compress({ uncompressed.first + body_start, uncompressed.second - body_start });
 
     std::vector<u8> result;
-    result.reserve(uncompressed.size());
+    result.reserve(uncompressed.second);
     Encoder encoder(result);
 
-    result.insert(result.end(), uncompressed.cbegin(), uncompressed.cbegin() + PREAMBLE_BYTES);
+    result.insert(result.end(), uncompressed.first, uncompressed.first + PREAMBLE_BYTES);
     result.push_back(BLOCK_TYPE_DEFLATE);
     encoder.encode(deflated.size());
     vector_extend(result, std::move(deflated));
@@ -257,8 +252,8 @@ std::optional<std::string> Change::get_message() const {
     if (message.first == message.second) {
         return {};
     }
-    return std::string(bytes.uncompressed.cbegin() + message.first,
-        bytes.uncompressed.cbegin() + message.second);
+    auto uncompressed = bytes.get_uncompressed();
+    return std::string(uncompressed.first + message.first, uncompressed.first + message.second);
 }
 
 OldChange Change::decode() const {
@@ -267,7 +262,35 @@ OldChange Change::decode() const {
 }
 
 OperationIterator Change::iter_ops() const {
-    return OperationIterator(make_bin_slice(bytes.uncompressed), actors, ops);
+    return OperationIterator(bytes.get_uncompressed(), actors, ops);
+}
+
+ChangeOpIterator Change::import_ops(OpSetMetadata& m) const {
+    return ChangeOpIterator(bytes.get_uncompressed(), actors, ops, start_op, m);
+}
+
+void Change::drop_ops() {
+    if (compacted) {
+        return;
+    }
+
+    auto uncompressed = bytes.get_uncompressed();
+    auto extra = get_extra_bytes();
+    usize message_len = message.second - message.first;
+
+    std::vector<u8> kept;
+    kept.reserve(message_len + extra.second);
+    kept.insert(kept.end(), uncompressed.first + message.first, uncompressed.first + message.second);
+    kept.insert(kept.end(), extra.first, extra.first + extra.second);
+
+    message = { 0, message_len };
+    extra_bytes = { message_len, kept.size() };
+    bytes = ChangeBytes{};
+    bytes.uncompressed = std::move(kept);
+    body_start = 0;
+    ops = std::unordered_map<u32, Range>();
+    actors = std::vector<ActorId>{ actors[0] };
+    compacted = true;
 }
 
 /////////////////////////////////////////////////////////
@@ -304,10 +327,30 @@ Change Change::decode_change(std::vector<u8>&& _bytes) {
         bytes.isCompressed = false;
         bytes.uncompressed = std::move(_bytes);
     }
+
+    return decode_change(std::move(bytes));
+}
+
+Change Change::decode_change(const SharedBytes& buffer, const Range& range) {
+    BinSlice chunk = { buffer->cbegin() + range.first, range.second - range.first };
+    auto [chunktype, body] = ChangeBytes::decode_header_without_hash(chunk);
+
+    ChangeBytes bytes;
+    bytes.shared = buffer;
+    bytes.shared_range = range;
+    if (chunktype == BLOCK_TYPE_DEFLATE) {
+        bytes.isCompressed = true;
+        bytes.shared_compressed = true;
+        bytes.uncompressed = ChangeBytes::inflate_chunk(chunk, { 0, PREAMBLE_BYTES }, body);
+    }
+
+    return decode_change(std::move(bytes));
+}
+
+Change Change::decode_change(ChangeBytes&& bytes) {
     auto uncompressed = bytes.get_uncompressed();
 
-    ChangeHash hash;
-    std::tie(chunktype, hash, body) = ChangeBytes::decode_header(uncompressed);
+    auto [chunktype, hash, body] = ChangeBytes::decode_header(uncompressed);
 
     if (chunktype != BLOCK_TYPE_CHANGE) {
         throw std::runtime_error("wrong chunk type");
@@ -352,16 +395,22 @@ Change Change::decode_change(std::vector<u8>&& _bytes) {
 }
 
 ChangeBytes ChangeBytes::decompress_chunk(Range&& preamble, Range&& body, std::vector<u8>&& compressed) {
-    auto decompressed = deflate_decompress({ compressed.cbegin() + body.first, body.second - body.first });
+    auto result = inflate_chunk(make_bin_slice(compressed), preamble, body);
+
+    return { true, std::move(compressed), std::move(result) };
+}
+
+std::vector<u8> ChangeBytes::inflate_chunk(const BinSlice& compressed, const Range& preamble, const Range& body) {
+    auto decompressed = deflate_decompress({ compressed.first + body.first, body.second - body.first });
     std::vector<u8> result;
-    result.reserve(decompressed.size() + (preamble.second - preamble.first));
-    result.insert(result.end(), compressed.cbegin() + preamble.first, compressed.cbegin() + preamble.second);
+    result.reserve(decompressed.size() + (preamble.second - preamble.first) + 1 + LEB128_U64_MAX_BYTE_SIZE);
+    result.insert(result.end(), compressed.first + preamble.first, compressed.first + preamble.second);
     result.push_back(BLOCK_TYPE_CHANGE);
     Encoder encoder(result);
     encoder.encode((u64)decompressed.size());
     vector_extend(result, std::move(decompressed));
 
-    return { true, std::move(compressed), std::move(result) };
+    return result;
 }
 
 std::vector<ChangeHash> ChangeBytes::decode_hashes(const BinSlice& bytes, Range& cursor) {
@@ -478,6 +527,15 @@ std::vector<Change> Change::load_blocks(const BinSlice& bytes) {
     return changes;
 }
 
+std::vector<Change> Change::load_blocks(const SharedBytes& bytes) {
+    std::vector<Change> changes;
+    for (auto& slice : split_blocks(make_bin_slice(*bytes))) {
+        decode_block(slice, changes, bytes);
+    }
+
+    return changes;
+}
+
 std::vector<BinSlice> Change::split_blocks(const BinSlice& bytes) {
     std::vector<BinSlice> blocks;
     BinSlice cursor = bytes;
@@ -524,14 +582,59 @@ std::optional<Range> Change::pop_block(const BinSlice& bytes) {
     return Range{ 0, end };
 }
 
-void Change::decode_block(const BinSlice& bytes, std::vector<Change>& changes) {
+usize Change::split_complete_blocks(const BinSlice& bytes, std::vector<BinSlice>& blocks) {
+    usize consumed = 0;
+    while (consumed < bytes.second) {
+        BinSlice rest = { bytes.first + consumed, bytes.second - consumed };
+
+        usize magic_len = std::min(rest.second, MAGIC_BYTES.size());
+        if (!std::equal(rest.first, rest.first + magic_len, MAGIC_BYTES.cbegin())) {
+            throw std::runtime_error("wrong magic bytes");
+        }
+        if (rest.second <= HEADER_BYTES) {
+            break;
+        }
+
+        BinSlice body = { rest.first + HEADER_BYTES, rest.second - HEADER_BYTES };
+        BinSlice buf = body;
+        std::optional<usize> val;
+        Decoding::decode(buf, val);
+        if (!val.has_value()) {
+            if (body.second < LEB128_U64_MAX_BYTE_SIZE) {
+                // the chunk length itself is cut short
+                break;
+            }
+            throw std::overflow_error("decode u64");
+        }
+
+        usize len = body.second - buf.second;
+        if (*val > rest.second - HEADER_BYTES - len) {
+            break;
+        }
+
+        usize end = HEADER_BYTES + len + *val;
+        blocks.emplace_back(rest.first, end);
+        consumed += end;
+    }
+
+    return consumed;
+}
+
+void Change::decode_block(const BinSlice& bytes, std::vector<Change>& changes, const SharedBytes& shared) {
     if (bytes.first[PREAMBLE_BYTES] == BLOCK_TYPE_DOC) {
+        // the changes of a document chunk are re-encoded, there is nothing to share
         vector_extend(changes, decode_document(bytes));
         return;
     }
     if ((bytes.first[PREAMBLE_BYTES] == BLOCK_TYPE_CHANGE) ||
         (bytes.first[PREAMBLE_BYTES] == BLOCK_TYPE_DEFLATE)) {
-        changes.push_back(decode_change(std::vector<u8>(bytes.first, bytes.first + bytes.second)));
+        if (shared) {
+            usize start = bytes.first - shared->cbegin();
+            changes.push_back(decode_change(shared, { start, start + bytes.second }));
+        }
+        else {
+            changes.push_back(decode_change(std::vector<u8>(bytes.first, bytes.first + bytes.second)));
+        }
         return;
     }
 
@@ -716,3 +819,7 @@ OldChange OldChange::doc_change_to_uncompressed_change(DocChange&& change, const
 std::vector<Change> load_document(const BinSlice& bytes) {
     return Change::load_blocks(bytes);
 }
+
+std::vector<Change> load_document(const SharedBytes& bytes) {
+    return Change::load_blocks(bytes);
+}
@@ -5,6 +5,7 @@
 
 #include <string>
 #include <vector>
+#include <memory>
 #include <unordered_map>
 #include <utility>
 #include <optional>
@@ -27,29 +28,126 @@ constexpr usize CHUNK_START = 8;
 constexpr Range HASH_RANGE = { 4, 8 };
 
 struct Change;
+class History;
 struct ChunkIntermediate;
 
-std::vector<u8> encode_document(std::vector<ChangeHash>&& heads, const std::vector<Change>& changes,
-    OpSetIter&& doc_ops, const IndexedCache<ActorId>& actors_index, const std::vector<std::string_view>& props);
+// An immutable buffer of encoded chunks, shared by the changes loaded from it.
+using SharedBytes = std::shared_ptr<const std::vector<u8>>;
+
+// A value shared by its copies, so that copying it only counts a reference. It is never modified in
+// place, only replaced, which leaves the other copies as they were. Reads like a const `T`.
+template <class T>
+class Shared {
+public:
+    Shared() = default;
+    Shared(T&& value) : ptr(std::make_shared<T>(std::move(value))) {}
+
+    Shared& operator=(T&& value) {
+        ptr = std::make_shared<T>(std::move(value));
+        return *this;
+    }
+
+    const T& get() const {
+        static const T empty;
+        return ptr ? *ptr : empty;
+    }
+
+    operator const T&() const& {
+        return get();
+    }
+
+    // The value, moved out if no other copy shares it.
+    operator T() && {
+        if (ptr && (ptr.use_count() == 1)) {
+            return std::move(*ptr);
+        }
+        return get();
+    }
+
+    auto size() const {
+        return get().size();
+    }
+
+    bool empty() const {
+        return get().empty();
+    }
+
+    auto begin() const {
+        return get().cbegin();
+    }
+
+    auto end() const {
+        return get().cend();
+    }
+
+    auto cbegin() const {
+        return get().cbegin();
+    }
+
+    auto cend() const {
+        return get().cend();
+    }
+
+    template <class K>
+    decltype(auto) operator[](const K& index) const {
+        return get()[index];
+    }
+
+    friend bool operator==(const Shared& a, const Shared& b) {
+        return a.get() == b.get();
+    }
+
+    friend bool operator==(const Shared& a, const T& b) {
+        return a.get() == b;
+    }
+
+    friend bool operator==(const T& a, const Shared& b) {
+        return a == b.get();
+    }
+
+private:
+    std::shared_ptr<T> ptr;
+};
+
+std::vector<u8> encode_document(std::vector<ChangeHash>&& heads, const History& changes,
+    OpSetIter&& doc_ops, const std::vector<std::pair<ObjId, Op>>& collected, usize num_ops,
+    const IndexedCache<ActorId>& actors_index, const std::vector<std::string_view>& props);
 
 struct ChangeBytes {
     bool isCompressed = false;
 
-    std::vector<u8> compressed = {};
-    std::vector<u8> uncompressed = {};
+    // Shared by the copies of the change, which so copy no bytes.
+    Shared<std::vector<u8>> compressed = {};
+    Shared<std::vector<u8>> uncompressed = {};
+
+    // A change loaded from a shared buffer references its chunk there instead of owning a copy. If
+    // the chunk is compressed, only the uncompressed bytes are materialized.
+    SharedBytes shared = {};
+    Range shared_range = {};
+    bool shared_compressed = false;
 
     BinSlice get_uncompressed() const {
+        if (shared && !shared_compressed) {
+            return { shared->cbegin() + shared_range.first, shared_range.second - shared_range.first };
+        }
         return { uncompressed.cbegin(), uncompressed.size() };
     }
 
+    BinSlice get_compressed() const {
+        if (shared && shared_compressed) {
+            return { shared->cbegin() + shared_range.first, shared_range.second - shared_range.first };
+        }
+        return { compressed.cbegin(), compressed.size() };
+    }
+
     void compress(usize body_start);
 
     BinSlice raw() const {
         if (isCompressed) {
-            return { compressed.cbegin(), compressed.size() };
+            return get_compressed();
         }
         else {
-            return { uncompressed.cbegin(), uncompressed.size() };
+            return get_uncompressed();
         }
     }
 
@@ -62,6 +160,9 @@ struct ChangeBytes {
     // throw exception
     static ChangeBytes decompress_chunk(Range&& preamble, Range&& body, std::vector<u8>&& compressed);
 
+    // throw exception
+    static std::vector<u8> inflate_chunk(const BinSlice& compressed, const Range& preamble, const Range& body);
+
     // throw exception
     static std::vector<ChangeHash> decode_hashes(const BinSlice& bytes, Range& cursor);
 
@@ -156,13 +257,17 @@ struct Change {
     // The message of this change.
     Range message = {};
     // The actors referenced in this change.
-    std::vector<ActorId> actors = {};
+    Shared<std::vector<ActorId>> actors = {};
     // The dependencies of this change.
     std::vector<ChangeHash> deps = {};
-    std::unordered_map<u32, Range> ops = {};
+    // The columns of the ops in `bytes`. Like the bytes, the actors and the columns are decoded once
+    // and shared by the copies of the change, so passing a change around copies only its metadata.
+    Shared<std::unordered_map<u32, Range>> ops = {};
     Range extra_bytes = {};
     // The number of operations in this change.
     usize num_ops = 0;
+    // The ops were dropped by `drop_ops`, the bytes hold only the message and the extra bytes.
+    bool compacted = false;
 
     const ActorId& actor_id() const {
         return actors[0];
@@ -193,25 +298,45 @@ struct Change {
 
     OperationIterator iter_ops() const;
 
+    // Decode the ops of this change into the internal representation of the document `m`.
+    ChangeOpIterator import_ops(OpSetMetadata& m) const;
+
+
     BinSlice get_extra_bytes() const {
-        return { bytes.uncompressed.cbegin() + extra_bytes.first, extra_bytes.second - extra_bytes.first };
+        return { bytes.get_uncompressed().first + extra_bytes.first, extra_bytes.second - extra_bytes.first };
     }
 
     void compress() {
         bytes.compress(body_start);
     }
+
+    // Release the encoded chunk, keeping what a document chunk needs: the metadata, the message and
+    // the extra bytes. The ops of the change can then only be recovered from a document that
+    // contains them, so the change can no longer be sent or saved as a change chunk.
+    void drop_ops();
     
     // throw exception
     static std::vector<Change> load_blocks(const BinSlice& bytes);
 
+    // Change chunks reference `bytes` rather than copying it.
+    // throw exception
+    static std::vector<Change> load_blocks(const SharedBytes& bytes);
+
     // throw exception
     static std::vector<BinSlice> split_blocks(const BinSlice& bytes);
 
     // throw exception
     static std::optional<Range> pop_block(const BinSlice& bytes);
 
+    // Append the complete chunks at the start of `bytes` to `blocks`, and return the number of
+    // bytes they take. Unlike `split_blocks`, a chunk that is cut short, even inside its header, is
+    // not an error: it is left for the caller to complete.
+    // throw exception
+    static usize split_complete_blocks(const BinSlice& bytes, std::vector<BinSlice>& blocks);
+
+    // `bytes` is a slice of `shared` if it is set.
     // throw exception
-    static void decode_block(const BinSlice& bytes, std::vector<Change>& changes);
+    static void decode_block(const BinSlice& bytes, std::vector<Change>& changes, const SharedBytes& shared = {});
 
     // throw exception
     static std::vector<Change> decode_document(const BinSlice& bytes);
@@ -225,7 +350,17 @@ struct Change {
     // TryFrom<Vec<u8>> for Change
     // throw exception
     static Change decode_change(std::vector<u8>&& _bytes);
+
+    // Decode the change chunk at `range` of `buffer` without copying it.
+    // throw exception
+    static Change decode_change(const SharedBytes& buffer, const Range& range);
+
+    // throw exception
+    static Change decode_change(ChangeBytes&& bytes);
 };
 
 // throw exception
 std::vector<Change> load_document(const BinSlice& bytes);
+
+// throw exception
+std::vector<Change> load_document(const SharedBytes& bytes);
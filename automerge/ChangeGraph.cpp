@@ -3,41 +3,71 @@
 
 #include "ChangeGraph.h"
 
+VisitedSet& VisitedSet::start(usize len) {
+    static thread_local VisitedSet visited;
+
+    if (visited.marks.size() < len) {
+        visited.marks.resize(len, 0);
+    }
+
+    ++visited.epoch;
+    if (visited.epoch == 0) {
+        // the epoch wrapped around, marks of old traversals could match again
+        std::fill(visited.marks.begin(), visited.marks.end(), 0);
+        visited.epoch = 1;
+    }
+
+    return visited;
+}
+
 std::optional<ChangeHash> ChangeGraph::add_change(const Change& change, usize actor_idx) {
     auto& hash = change.hash;
     if (nodes_by_hash.count(hash)) {
         return {};
     }
 
-    std::vector<u32> parent_indics;
-    parent_indics.reserve(change.deps.size());
+    u32 parents_start = (u32)parents.size();
     for (auto& h : change.deps) {
-        try {
-            parent_indics.push_back(nodes_by_hash.at(h));
-        }
-        catch (std::out_of_range&) {
+        auto parent = nodes_by_hash.find(h);
+        if (parent == nodes_by_hash.end()) {
+            parents.resize(parents_start);
             return h;
         }
+        parents.push_back(parent->second);
     }
 
-    auto node_idx = add_node(actor_idx, change);
+    auto node_idx = add_node(actor_idx, change, parents_start);
     nodes_by_hash.insert({ hash, node_idx });
-    for (auto parent_idx : parent_indics) {
-        add_parent(node_idx, parent_idx);
-    }
+    update_clock_cache(node_idx);
 
     return {};
 }
 
-u32 ChangeGraph::add_node(usize actor_index, const Change& change) {
+void ChangeGraph::set_clock_cache(u32 interval, usize max_clocks) {
+    clock_interval = std::max(interval, 1u);
+    max_cached_clocks = max_clocks;
+    while (checkpoints.size() > max_cached_clocks) {
+        thin_clock_cache();
+    }
+}
+
+u32 ChangeGraph::add_node(usize actor_index, const Change& change, u32 parents_start) {
     u32 idx = (u32)nodes.size();
     auto hash_idx = add_hash(ChangeHash(change.hash));
+
+    u32 generation = 0;
+    for (u32 i = parents_start; i < parents.size(); ++i) {
+        generation = std::max(generation, nodes[parents[i]].generation);
+    }
+
     nodes.push_back({
         hash_idx,
         actor_index,
         change.seq,
         change.max_op(),
-        {}
+        parents_start,
+        (u32)parents.size(),
+        generation + 1
         });
 
     return idx;
@@ -50,80 +80,245 @@ u32 ChangeGraph::add_hash(ChangeHash&& hash) {
     return idx;
 }
 
-void ChangeGraph::add_parent(u32 child_idx, u32 parent_idx) {
-    u32 new_edge_idx = (u32)edges.size();
-    edges.push_back({ parent_idx, {} });
+void ChangeGraph::update_clock_cache(u32 node_idx) {
+    u32 depth = 0;
+    auto& node = nodes[node_idx];
+    for (u32 i = node.parents_start; i < node.parents_end; ++i) {
+        depth = std::max(depth, nodes[parents[i]].uncached_depth);
+    }
+    ++depth;
+
+    if ((depth < clock_interval) || !max_cached_clocks) {
+        nodes[node_idx].uncached_depth = depth;
+        return;
+    }
+
+    cached_clocks.emplace(node_idx, clock_for_nodes({ node_idx }));
+    checkpoints.push_back(node_idx);
+    nodes[node_idx].uncached_depth = 0;
+
+    if (checkpoints.size() > max_cached_clocks) {
+        thin_clock_cache();
+    }
+}
 
-    auto& child = nodes[child_idx];
-    auto& edge_idx = child.parents;
-    if (edge_idx) {
-        auto edge = &edges[*edge_idx];
-        while (edge->next) {
-            edge = &edges[*edge->next];
+void ChangeGraph::thin_clock_cache() {
+    std::vector<u32> kept;
+    kept.reserve(checkpoints.size() / 2);
+    for (usize i = 0; i < checkpoints.size(); ++i) {
+        if (i % 2) {
+            kept.push_back(checkpoints[i]);
+        }
+        else {
+            cached_clocks.erase(checkpoints[i]);
         }
-        edge->next = new_edge_idx;
     }
-    else {
-        child.parents = new_edge_idx;
+    checkpoints = std::move(kept);
+
+    if (clock_interval <= UINT32_MAX / 2) {
+        clock_interval *= 2;
     }
 }
 
 Clock ChangeGraph::clock_for_heads(const std::vector<ChangeHash>& heads) const {
+    std::vector<u32> to_visit;
+    to_visit.reserve(heads.size());
+    for (auto& h : heads) {
+        auto node_iter = nodes_by_hash.find(h);
+        if (node_iter != nodes_by_hash.end()) {
+            to_visit.push_back(node_iter->second);
+        }
+    }
+
+    return clock_for_nodes(std::move(to_visit));
+}
+
+Clock ChangeGraph::clock_for_nodes(std::vector<u32>&& to_visit) const {
     Clock clock;
 
-    traverse_ancestors(heads, [&clock](const ChangeNode& node, const ChangeHash& _hash) {
-        clock.include(
-            node.actor_index,
-            ClockData{
-                node.max_op,
-                node.seq
-            }
-        );
+    traverse_ancestors(std::move(to_visit), [&](u32 idx, const ChangeNode& node) {
+        // the cached clock covers all ancestors of the node
+        auto cached = cached_clocks.find(idx);
+        if (cached != cached_clocks.end()) {
+            clock.merge(cached->second);
+            return false;
+        }
+
+        clock.include(node.actor_index, ClockData{ node.max_op, node.seq });
+        return true;
     });
 
     return clock;
 }
 
+// The changes of an actor form a chain, each depends on the one before it, so a change is an
+// ancestor of the heads if the clock of the heads has reached its seq.
 void ChangeGraph::remove_ancestors(std::set<ChangeHash>& changes, const std::vector<ChangeHash>& heads) const {
-    traverse_ancestors(heads, [&changes](const ChangeNode& _node, const ChangeHash& hash) {
-        changes.erase(hash);
+    u32 max_generation = 0;
+    for (auto& h : heads) {
+        auto node_iter = nodes_by_hash.find(h);
+        if (node_iter != nodes_by_hash.end()) {
+            max_generation = std::max(max_generation, nodes[node_iter->second].generation);
+        }
+    }
+
+    std::vector<std::set<ChangeHash>::iterator> candidates;
+    for (auto iter = changes.begin(); iter != changes.end(); ++iter) {
+        auto node_iter = nodes_by_hash.find(*iter);
+        // a change of a higher generation than all heads cannot be an ancestor of them
+        if ((node_iter != nodes_by_hash.end()) && (nodes[node_iter->second].generation <= max_generation)) {
+            candidates.push_back(iter);
+        }
+    }
+    if (candidates.empty()) {
+        return;
+    }
+
+    auto clock = clock_for_heads(heads);
+    for (auto iter : candidates) {
+        auto& node = nodes[nodes_by_hash.find(*iter)->second];
+        auto data = clock.get_for_actor(node.actor_index);
+        if (data && (data->seq >= node.seq)) {
+            changes.erase(iter);
+        }
+    }
+}
+
+bool ChangeGraph::is_ancestor(const ChangeHash& ancestor, const ChangeHash& descendant) const {
+    auto ancestor_iter = nodes_by_hash.find(ancestor);
+    auto descendant_iter = nodes_by_hash.find(descendant);
+    if ((ancestor_iter == nodes_by_hash.end()) || (descendant_iter == nodes_by_hash.end())) {
+        return false;
+    }
+
+    return is_ancestor(ancestor_iter->second, descendant_iter->second);
+}
+
+bool ChangeGraph::is_ancestor(u32 ancestor, u32 descendant) const {
+    if (ancestor == descendant) {
+        return true;
+    }
+
+    auto& target = nodes[ancestor];
+    if (target.generation >= nodes[descendant].generation) {
+        return false;
+    }
+    if (target.actor_index == nodes[descendant].actor_index) {
+        return target.seq < nodes[descendant].seq;
+    }
+
+    bool found = false;
+    traverse_ancestors({ descendant }, [&](u32 idx, const ChangeNode& node) {
+        if (found || (node.generation < target.generation)) {
+            return false;
+        }
+        if ((idx == ancestor) || ((node.actor_index == target.actor_index) && (node.seq >= target.seq))) {
+            found = true;
+            return false;
+        }
+        if (node.generation == target.generation) {
+            return false;
+        }
+
+        // the cached clock covers all ancestors of the node
+        auto cached = cached_clocks.find(idx);
+        if (cached != cached_clocks.end()) {
+            auto data = cached->second.get_for_actor(target.actor_index);
+            found = data && (data->seq >= target.seq);
+            return false;
+        }
+
+        return true;
     });
+
+    return found;
 }
 
-void ChangeGraph::traverse_ancestors(
-    const std::vector<ChangeHash>& heads, 
-    std::function<void(const ChangeNode&, const ChangeHash&)> f
-) const {
-    std::vector<u32> to_visit;
-    to_visit.reserve(heads.size());
-    for (auto& h : heads) {
+std::vector<ChangeHash> ChangeGraph::common_ancestors(const std::vector<ChangeHash>& heads1, const std::vector<ChangeHash>& heads2) const {
+    enum : u8 {
+        LEFT = 1,
+        RIGHT = 2,
+        // an ancestor of a common ancestor
+        STALE = 4
+    };
+
+    std::unordered_map<u32, u8> flags;
+    auto higher = [this](const std::pair<u32, bool>& a, const std::pair<u32, bool>& b) {
+        return nodes[a.first].generation < nodes[b.first].generation;
+    };
+    // (node, whether it was pushed before it was known to be stale)
+    std::priority_queue<std::pair<u32, bool>, std::vector<std::pair<u32, bool>>, decltype(higher)> queue(higher);
+    usize not_stale = 0;
+
+    auto push = [&](u32 idx, u8 flag) {
+        auto& f = flags[idx];
+        if ((f & flag) == flag) {
+            return;
+        }
+        f |= flag;
+
+        bool counted = !(f & STALE);
+        not_stale += counted;
+        queue.push({ idx, counted });
+    };
+
+    for (auto& h : heads1) {
         auto node_iter = nodes_by_hash.find(h);
-        if  (node_iter != nodes_by_hash.end()) {
-            to_visit.push_back(node_iter->second);
+        if (node_iter != nodes_by_hash.end()) {
+            push(node_iter->second, LEFT);
+        }
+    }
+    for (auto& h : heads2) {
+        auto node_iter = nodes_by_hash.find(h);
+        if (node_iter != nodes_by_hash.end()) {
+            push(node_iter->second, RIGHT);
         }
     }
 
-    std::set<u32> visited;
-    while (!to_visit.empty()) {
-        auto idx = vector_pop(to_visit);
+    // The queue pops the highest generation first, so all descendants of a node in the walk are
+    // handled before it, and it has all of their flags when it is popped.
+    std::vector<u32> found;
+    while (not_stale) {
+        auto [idx, counted] = queue.top();
+        queue.pop();
+        not_stale -= counted;
 
-        if (visited.count(idx)) {
-            continue;
-        }
-        else {
-            visited.insert(idx);
+        u8 f = flags[idx];
+        if (((f & (LEFT | RIGHT)) == (LEFT | RIGHT)) && !(f & STALE)) {
+            found.push_back(idx);
+            f |= STALE;
+            flags[idx] = f;
         }
 
         auto& node = nodes[idx];
-        auto& hash = hashes[node.hash_idx];
-        f(node, hash);
+        for (u32 i = node.parents_start; i < node.parents_end; ++i) {
+            push(parents[i], f);
+        }
+    }
 
-        // fn parents
-        auto edge_idx = nodes[idx].parents;
-        while (edge_idx.has_value()) {
-            auto& edge = edges[*edge_idx];
-            edge_idx = edge.next;
-            to_visit.push_back(edge.target);
+    // A node found later has a lower generation so it is no descendant of one found before, and if
+    // it were an ancestor of one it would have been stale.
+    std::vector<ChangeHash> res;
+    res.reserve(found.size());
+    for (auto idx : found) {
+        res.push_back(hashes[nodes[idx].hash_idx]);
+    }
+    std::sort(res.begin(), res.end());
+
+    return res;
+}
+
+void ChangeGraph::remove_redundant_heads(std::vector<ChangeHash>& heads) const {
+    std::vector<ChangeHash> kept;
+    kept.reserve(heads.size());
+    for (usize i = 0; i < heads.size(); ++i) {
+        bool redundant = false;
+        for (usize j = 0; (j < heads.size()) && !redundant; ++j) {
+            redundant = (i != j) && !(heads[i] == heads[j]) && is_ancestor(heads[i], heads[j]);
+        }
+        if (!redundant) {
+            kept.push_back(heads[i]);
         }
     }
+    heads = std::move(kept);
 }
@@ -7,7 +7,9 @@
 #include <vector>
 #include <unordered_map>
 #include <map>
+#include <unordered_set>
 #include <set>
+#include <queue>
 #include <utility>
 #include <algorithm>
 #include <optional>
@@ -18,14 +20,7 @@
 #include "type.h"
 #include "Clock.h"
 #include "Change.h"
-
-// #[derive(Debug, Clone)]
-struct Edge {
-    // Edges are always child -> parent so we only store the target, the child is implicit
-    // as you get the edge from the child
-    u32 target;
-    std::optional<u32> next;
-};
+#include "helper.h"
 
 // #[derive(Debug, Clone)]
 struct ChangeNode {
@@ -33,38 +28,120 @@ struct ChangeNode {
     usize actor_index;
     u64 seq;
     u64  max_op;
-    std::optional<u32> parents;
+    // The parents of this node are `ChangeGraph::parents[parents_start..parents_end]`.
+    u32 parents_start;
+    u32 parents_end;
+    // One more than the largest generation of the parents, 1 for a root. Generations strictly
+    // decrease along every path to the ancestors.
+    u32 generation;
+    // The length of the longest path from this node to a node with a cached clock, or to a root.
+    u32 uncached_depth = 0;
 };
 
+// The nodes visited by a traversal. A node is visited if its mark is the epoch of the traversal,
+// so starting a traversal is an increment rather than clearing a set.
+// Each thread has one set, shared by every graph it traverses.
+struct VisitedSet {
+    std::vector<u32> marks;
+    u32 epoch = 0;
+
+    // Start a traversal of a graph with `len` nodes.
+    static VisitedSet& start(usize len);
+
+    // Returns false if the node was already visited.
+    bool insert(u32 idx) {
+        if (marks[idx] == epoch) {
+            return false;
+        }
+        marks[idx] = epoch;
+        return true;
+    }
+};
+
+// By default a node caches its clock once a path of 64 nodes leads from it to the nearest cached
+// clock, and at most 1024 clocks are cached.
+constexpr u32 DEFAULT_CLOCK_INTERVAL = 64;
+constexpr usize DEFAULT_MAX_CACHED_CLOCKS = 1024;
+
 // The graph of changes
 //
-// This is a sort of adjacency list based representation, except that instead of using linked
-// lists, we keep all the edges and nodes in two vecs and reference them by index which plays nice
-// with the cache
+// A change is added together with all of its parents and never changes afterwards, so the
+// parents of each node are stored contiguously in a single vec (a compressed sparse row layout).
+// Nodes and parents are referenced by index which plays nice with the cache.
 // #[derive(Debug, Clone)]
 struct ChangeGraph {
     std::vector<ChangeNode> nodes;
-    std::vector<Edge> edges;
+    std::vector<u32> parents;
     std::vector<ChangeHash> hashes;
-    std::map<ChangeHash, u32> nodes_by_hash;
-    
+    std::unordered_map<ChangeHash, u32> nodes_by_hash;
+    // Checkpointed clocks, each covers its node and all of its ancestors. Computing the clock of
+    // some heads stops at these nodes, so it walks at most about `clock_interval` nodes deep
+    // rather than the whole history.
+    std::unordered_map<u32, Clock> cached_clocks;
+    // The nodes with a cached clock, in the order they were added.
+    std::vector<u32> checkpoints;
+    u32 clock_interval = DEFAULT_CLOCK_INTERVAL;
+    usize max_cached_clocks = DEFAULT_MAX_CACHED_CLOCKS;
+
     // success: return null; fail: return missing dep
     std::optional<ChangeHash> add_change(const Change& change, usize actor_idx);
 
+    // Cache a clock once `interval` uncached nodes lead to a node, and keep at most `max_clocks`
+    // clocks. A cached clock takes 16 bytes per actor of the document.
+    // When the limit is reached every other cached clock is dropped and the interval is doubled,
+    // so the memory stays bounded as the history grows and walks get only logarithmically longer.
+    void set_clock_cache(u32 interval, usize max_clocks);
+
     Clock clock_for_heads(const std::vector<ChangeHash>& heads) const;
 
     void remove_ancestors(std::set<ChangeHash>& changes, const std::vector<ChangeHash>& heads) const;
 
-private:
-    u32 add_node(usize actor_index, const Change& change);
+    // Whether `ancestor` is `descendant` or one of its ancestors. False if either is unknown.
+    // Only nodes of a higher generation than `ancestor` are walked, and a walk stops at cached
+    // clocks, so changes that are close or of the same actor are answered quickly.
+    bool is_ancestor(const ChangeHash& ancestor, const ChangeHash& descendant) const;
 
-    u32 add_hash(ChangeHash&& hash);
+    // The latest changes that are ancestors of both `heads1` and `heads2`, sorted. None of them is
+    // an ancestor of another.
+    // Both sides are walked together from the highest generation down, and the walk ends once only
+    // ancestors of common ancestors are left, so recently diverged heads are cheap.
+    std::vector<ChangeHash> common_ancestors(const std::vector<ChangeHash>& heads1, const std::vector<ChangeHash>& heads2) const;
 
-    void add_parent(u32 child_idx, u32 parent_idx);
+    // Remove the heads that are ancestors of other heads.
+    void remove_redundant_heads(std::vector<ChangeHash>& heads) const;
 
-    // Call `f` for each (node, hash) in the graph, starting from the given heads
+    // Call `f(idx, node)` for each node reachable from the nodes in `to_visit`. The parents of a
+    // node are visited if `f` returns true.
     //
     // No guarantees are made about the order of traversal but each node will only be visited
-    // once.
-    void traverse_ancestors(const std::vector<ChangeHash>& heads, std::function<void(const ChangeNode&, const ChangeHash&)> f) const;
+    // once. `f` must not start another traversal.
+    template<class F>
+    void traverse_ancestors(std::vector<u32>&& to_visit, F&& f) const {
+        auto& visited = VisitedSet::start(nodes.size());
+        while (!to_visit.empty()) {
+            auto idx = vector_pop(to_visit);
+            if (!visited.insert(idx)) {
+                continue;
+            }
+
+            auto& node = nodes[idx];
+            if (f(idx, node)) {
+                to_visit.insert(to_visit.end(), parents.cbegin() + node.parents_start, parents.cbegin() + node.parents_end);
+            }
+        }
+    }
+
+private:
+    u32 add_node(usize actor_index, const Change& change, u32 parents_start);
+
+    u32 add_hash(ChangeHash&& hash);
+
+    // Cache the clock of the node if it is `clock_interval` nodes away from the nearest cached clock.
+    void update_clock_cache(u32 node_idx);
+
+    void thin_clock_cache();
+
+    Clock clock_for_nodes(std::vector<u32>&& to_visit) const;
+
+    bool is_ancestor(u32 ancestor, u32 descendant) const;
 };
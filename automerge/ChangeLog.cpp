@@ -0,0 +1,159 @@
+// Copyright (c) 2022 the VGG Automerge contributors
+// This code is licensed under MIT license (see LICENSE for details)
+
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "ChangeLog.h"
+
+namespace fs = std::filesystem;
+
+// Flush the buffered writes of `file` and wait until they reach the disk.
+static bool sync_file(FILE* file) {
+    if (std::fflush(file) != 0) {
+        return false;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// Make a rename in `dir` durable. Windows has no equivalent, a rename is durable once it returns.
+static void sync_directory(const fs::path& dir) {
+#ifndef _WIN32
+    int fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        ::close(fd);
+    }
+#endif
+}
+
+ChangeLog::ChangeLog(const std::string& path, usize min_compact_bytes) :
+    file_path(path), min_compact_bytes(min_compact_bytes) {
+    // a torn chunk would be followed by the next append, and hide it
+    std::shared_ptr<std::vector<u8>> data;
+    std::vector<BinSlice> blocks;
+    usize len = read(file_path, data, blocks);
+    if (data && (len < data->size())) {
+        fs::resize_file(file_path, len);
+    }
+
+    open();
+}
+
+ChangeLog::~ChangeLog() {
+    close();
+}
+
+Automerge ChangeLog::load(const std::string& path, usize* valid_bytes) {
+    std::shared_ptr<std::vector<u8>> data;
+    std::vector<BinSlice> blocks;
+    usize len = read(path, data, blocks);
+    if (valid_bytes) {
+        *valid_bytes = len;
+    }
+
+    Automerge doc;
+    std::vector<Change> changes;
+    for (auto& block : blocks) {
+        Change::decode_block(block, changes, data);
+    }
+    doc.apply_changes(std::move(changes));
+    doc.saved = doc.get_heads();
+
+    return doc;
+}
+
+usize ChangeLog::read(const std::string& path, std::shared_ptr<std::vector<u8>>& data, std::vector<BinSlice>& blocks) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        return 0;
+    }
+
+    auto size = file.tellg();
+    data = std::make_shared<std::vector<u8>>((usize)size);
+    file.seekg(0);
+    if (!file.read(reinterpret_cast<char*>(data->data()), size)) {
+        throw std::runtime_error("failed to read " + path);
+    }
+
+    return Change::split_complete_blocks(make_bin_slice(*data), blocks);
+}
+
+usize ChangeLog::append(Automerge& doc) {
+    auto heads = doc.saved;
+    auto bytes = doc.save_incremental();
+    if (bytes.empty()) {
+        return 0;
+    }
+
+    if (std::fwrite(bytes.data(), 1, bytes.size(), file) != bytes.size() || !sync_file(file)) {
+        // drop what was written of the batch, the next append writes it again
+        doc.saved = std::move(heads);
+        close();
+        fs::resize_file(file_path, size());
+        open();
+        throw std::runtime_error("failed to append to " + file_path);
+    }
+    appended_bytes += bytes.size();
+
+    if (should_compact()) {
+        compact(doc);
+    }
+
+    return bytes.size();
+}
+
+void ChangeLog::compact(Automerge& doc) {
+    auto bytes = doc.save();
+
+    auto temp_path = file_path + ".tmp";
+    FILE* temp = std::fopen(temp_path.c_str(), "wb");
+    if (!temp) {
+        throw std::runtime_error("failed to open " + temp_path);
+    }
+    bool written = (std::fwrite(bytes.data(), 1, bytes.size(), temp) == bytes.size()) && sync_file(temp);
+    std::fclose(temp);
+    if (!written) {
+        std::error_code ec;
+        fs::remove(temp_path, ec);
+        throw std::runtime_error("failed to write " + temp_path);
+    }
+
+    close();
+    fs::rename(temp_path, file_path);
+    sync_directory(fs::path(file_path).parent_path());
+    open();
+}
+
+void ChangeLog::open() {
+    file = std::fopen(file_path.c_str(), "ab");
+    if (!file) {
+        throw std::runtime_error("failed to open " + file_path);
+    }
+
+    base_bytes = fs::file_size(file_path);
+    appended_bytes = 0;
+}
+
+void ChangeLog::close() {
+    if (file) {
+        std::fclose(file);
+        file = nullptr;
+    }
+}
+
+bool ChangeLog::should_compact() const {
+    return appended_bytes > std::max(min_compact_bytes, base_bytes);
+}
@@ -0,0 +1,79 @@
+// Copyright (c) 2022 the VGG Automerge contributors
+// This code is licensed under MIT license (see LICENSE for details)
+
+#pragma once
+
+#include <cstdio>
+#include <memory>
+#include <string>
+
+#include "type.h"
+#include "Automerge.h"
+
+// Once the changes appended since the last compaction take more than this many bytes, and more
+// than the compacted document itself, the log is compacted.
+constexpr usize CHANGE_LOG_MIN_COMPACT_BYTES = 1 << 20;
+
+// An append-only file of a document: a document chunk followed by the change chunks saved since.
+// Each `append` writes the changes since the last save as one batch and syncs it to disk, so an
+// autosave costs only the new changes. When the appended changes outgrow the document chunk, the
+// log is rewritten as a single document chunk, so the file stays within about twice the size of
+// the saved document and loading it does not replay a long tail of changes.
+class ChangeLog {
+public:
+    // Open the log at `path` for appending, creating it if it does not exist. A trailing chunk torn
+    // by a crash during an append is cut off the file first, so the next append follows the last
+    // complete chunk.
+    // throw exception
+    explicit ChangeLog(const std::string& path, usize min_compact_bytes = CHANGE_LOG_MIN_COMPACT_BYTES);
+
+    ChangeLog(const ChangeLog&) = delete;
+    ChangeLog& operator=(const ChangeLog&) = delete;
+
+    ~ChangeLog();
+
+    // Load the document in the log at `path`, or an empty document if there is none.
+    // A trailing chunk torn by a crash during an append is skipped, the file is left as it is. The
+    // bytes of the complete chunks are stored in `valid_bytes`, if given.
+    // throw exception
+    static Automerge load(const std::string& path, usize* valid_bytes = nullptr);
+
+    // Write the changes of `doc` since its last save to the log, and sync them to disk.
+    // Returns the number of bytes appended.
+    // throw exception
+    usize append(Automerge& doc);
+
+    // Replace the log with a single document chunk of `doc`. The new log is written to a temporary
+    // file which is then renamed over the old one, so a crash leaves either the old or the new log.
+    // throw exception
+    void compact(Automerge& doc);
+
+    const std::string& path() const {
+        return file_path;
+    }
+
+    // The size of the log file.
+    usize size() const {
+        return base_bytes + appended_bytes;
+    }
+
+private:
+    std::string file_path;
+    usize min_compact_bytes;
+    FILE* file = nullptr;
+    // The size of the log at the last compaction, or when it was opened.
+    usize base_bytes = 0;
+    // The bytes appended since.
+    usize appended_bytes = 0;
+
+    void open();
+
+    // Read the log at `path` into `data`, and return the bytes of its complete chunks, or 0 if
+    // there is no log.
+    // throw exception
+    static usize read(const std::string& path, std::shared_ptr<std::vector<u8>>& data, std::vector<BinSlice>& blocks);
+
+    void close();
+
+    bool should_compact() const;
+};
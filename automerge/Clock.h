@@ -30,6 +30,12 @@ struct ClockData {
         return cmp(other) < 0;
     }
 
+    // Whether `other` is a later change of the same actor. An empty change has the max_op of the
+    // change before it, so the seq breaks the tie.
+    bool is_older(const ClockData& other) const {
+        return (max_op < other.max_op) || ((max_op == other.max_op) && (seq < other.seq));
+    }
+
     int cmp(const ClockData& other) const {
         if (max_op < other.max_op)
             return -1;
@@ -40,9 +46,12 @@ struct ClockData {
 };
 
 // Vector clock mapping actor indices to the max op counter of the changes created by that actor.
+// The entries are stored densely, indexed by the actor index of the document, so lookups are a
+// bounds check and comparing two clocks is a single linear pass.
+// An actor the clock has no entry for has a seq of 0, as the seqs of changes start at 1.
 // #[derive(Default, Debug, Clone, PartialEq)]
 struct Clock {
-    std::unordered_map<usize, ClockData> clock;
+    std::vector<ClockData> clock;
 
     // A general clock is greater if it has one element the other does not or has a counter higher than
     // the other for a given actor.
@@ -51,84 +60,90 @@ struct Clock {
     //
     // It is less than another clock otherwise.
     std::optional<int> cmp(const Clock& other) const {
-        if (clock == other.clock)
-            return { 0 };
-        if (is_greater(other))
+        bool has_greater = false;
+        bool has_less = false;
+
+        usize len = std::max(clock.size(), other.clock.size());
+        for (usize actor_index = 0; actor_index < len; ++actor_index) {
+            auto data = get(actor_index);
+            auto other_data = other.get(actor_index);
+            if (data) {
+                // other doesn't have this so effectively has a less element
+                has_greater |= (!other_data || (*other_data < *data));
+                has_less |= (other_data && (*data < *other_data));
+            }
+            else {
+                has_less |= (other_data != nullptr);
+            }
+
+            if (has_greater && has_less) {
+                // concurrent
+                return std::nullopt;
+            }
+        }
+
+        if (has_greater) {
             return { 1 };
-        if (other.is_greater(*this)) {
+        }
+        if (has_less) {
             return { -1 };
         }
+        return { 0 };
+    }
 
-        // concurrent
-        return std::nullopt;
+    bool is_greater(const Clock& other) const {
+        auto res = cmp(other);
+        return res && (*res > 0);
     }
 
     void include(usize actor_index, ClockData data) {
-        try {
-            auto& d = clock.at(actor_index);
-            if (data.max_op > d.max_op) {
-                d = data;
-            }
+        if (actor_index >= clock.size()) {
+            clock.resize(actor_index + 1);
         }
-        catch (std::out_of_range&) {
-            clock.insert({ actor_index, data });
+
+        auto& d = clock[actor_index];
+        if (!d.seq || d.is_older(data)) {
+            d = data;
         }
     }
 
-    bool covers(const OpId& id) const {
-        try {
-            auto& data = clock.at(id.actor);
-            return data.max_op >= id.counter;
+    // Include every entry of `other`.
+    void merge(const Clock& other) {
+        if (other.clock.size() > clock.size()) {
+            clock.resize(other.clock.size());
         }
-        catch (std::out_of_range&) {
-            return false;
+
+        for (usize actor_index = 0; actor_index < other.clock.size(); ++actor_index) {
+            auto& data = other.clock[actor_index];
+            if (data.seq) {
+                include(actor_index, data);
+            }
         }
     }
 
-    std::optional<ClockData> get_for_actor(usize actor_index) {
-        try {
-            return clock.at(actor_index);
-        }
-        catch (std::out_of_range&) {
-            return {};
-        }
+    bool covers(const OpId& id) const {
+        auto data = get(id.actor);
+        return data && (data->max_op >= id.counter);
     }
 
-private:
-    bool is_greater(const Clock& other) const {
-        bool has_greater = false;
-        usize others_found = 0;
-
-        for (auto& [actor, data] : clock) {
-            try {
-                auto& other_data = other.clock.at(actor);
-                if (data < other_data) {
-                    // may be concurrent or less
-                    return false;
-                }
-                else if (other_data < data) {
-                    has_greater = true;
-                }
-                ++others_found;
-            }
-            catch (std::out_of_range&) {
-                // other doesn't have this so effectively has a greater element
-                has_greater = true;
-            }
+    std::optional<ClockData> get_for_actor(usize actor_index) const {
+        auto data = get(actor_index);
+        if (data) {
+            return *data;
         }
+        return {};
+    }
 
-        if (has_greater) {
-            // if they are equal then we have seen every key in the other clock and have at least
-            // one greater element so our clock is greater
-            //
-            // If they aren't the same then we haven't seen every key but have a greater element
-            // anyway so are concurrent
-            return (others_found == other.clock.size());
-        }
-        else {
-            // our clock doesn't have anything greater than the other clock so can't be greater but
-            // could still be concurrent
-            return false;
+    bool operator==(const Clock& other) const {
+        auto res = cmp(other);
+        return res && (*res == 0);
+    }
+
+private:
+    const ClockData* get(usize actor_index) const {
+        if ((actor_index < clock.size()) && clock[actor_index].seq) {
+            return &clock[actor_index];
         }
+        return nullptr;
     }
 };
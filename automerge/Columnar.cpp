@@ -6,6 +6,7 @@
 
 #include "Columnar.h"
 #include "Change.h"
+#include "History.h"
 #include "leb128.h"
 
 std::optional<OldObjectId> ObjIterator::next() {
@@ -265,6 +266,32 @@ std::optional<std::vector<u8>> ExtraIterator::next() {
 
 /////////////////////////////////////////////////////////
 
+static std::optional<OpType> action_to_op_type(Action action, ScalarValue&& value) {
+    switch (action) {
+    case Action::Set:
+        return OpType{ OpType::Put, std::move(value) };
+    case Action::MakeList:
+        return OpType{ OpType::Make, ObjType::List };
+    case Action::MakeText:
+        return OpType{ OpType::Make, ObjType::Text };
+    case Action::MakeMap:
+        return OpType{ OpType::Make, ObjType::Map };
+    case Action::MakeTable:
+        return OpType{ OpType::Make, ObjType::Table };
+    case Action::Del:
+        return OpType{ OpType::Delete };
+    case Action::Inc: {
+        auto num = value.to_s64();
+        if (!num.has_value()) {
+            return {};
+        }
+        return OpType{ OpType::Increment, *num };
+    }
+    default:
+        return OpType{};
+    }
+}
+
 OperationIterator::OperationIterator(const BinSlice& bytes, const std::vector<ActorId>& actors,
     const std::unordered_map<u32, Range>& ops) {
     objs = ObjIterator{
@@ -326,40 +353,13 @@ std::optional<OldOp> OperationIterator::next() {
         return {};
     }
 
-    OpType act;
-    switch (**action_next) {
-    case Action::Set:
-        act = { OpType::Put, std::move(*value_next) };
-        break;
-    case Action::MakeList:
-        act = { OpType::Make, ObjType::List };
-        break;
-    case Action::MakeText:
-        act = { OpType::Make, ObjType::Text };
-        break;
-    case Action::MakeMap:
-        act = { OpType::Make, ObjType::Map };
-        break;
-    case Action::MakeTable:
-        act = { OpType::Make, ObjType::Table };
-        break;
-    case Action::Del:
-        act = { OpType::Delete };
-        break;
-    case Action::Inc: {
-        auto num = value_next->to_s64();
-        if (!num.has_value()) {
-            return {};
-        }
-        act = { OpType::Increment, *num };
-        break;
-    }
-    default:
-        break;
+    auto act = action_to_op_type(**action_next, std::move(*value_next));
+    if (!act.has_value()) {
+        return {};
     }
 
     return OldOp(
-        std::move(act),
+        std::move(*act),
         std::move(*obj),
         std::move(*key),
         std::move(*pred_next),
@@ -376,6 +376,166 @@ usize OperationIterator::count() {
     return res;
 }
 
+ChangeOpIterator::ChangeOpIterator(const BinSlice& bytes, const std::vector<ActorId>& change_actors,
+    const std::unordered_map<u32, Range>& ops, u64 start_op, OpSetMetadata& meta) : m(&meta), counter(start_op)
+{
+    actors.reserve(change_actors.size());
+    for (auto& actor : change_actors) {
+        actors.push_back(m->cache_actor(ActorId(actor)));
+    }
+    author = actors.empty() ? 0 : actors[0];
+
+    action = col_iter<RleDecoder<Action>>(bytes, ops, COL_ACTION);
+    insert = col_iter<BooleanDecoder>(bytes, ops, COL_INSERT);
+    obj_actor = col_iter<RleDecoder<usize>>(bytes, ops, COL_OBJ_ACTOR);
+    obj_ctr = col_iter<RleDecoder<u64>>(bytes, ops, COL_OBJ_CTR);
+    key_actor = col_iter<RleDecoder<usize>>(bytes, ops, COL_KEY_ACTOR);
+    key_ctr = col_iter<DeltaDecoder>(bytes, ops, COL_KEY_CTR);
+    key_str = col_iter<RleDecoder<BinSlice>>(bytes, ops, COL_KEY_STR);
+    value = ValueIterator{
+        &change_actors,
+        col_iter<RleDecoder<usize>>(bytes, ops, COL_VAL_LEN),
+        col_iter<Decoder>(bytes, ops, COL_VAL_RAW),
+        col_iter<RleDecoder<usize>>(bytes, ops, COL_REF_ACTOR),
+        col_iter<RleDecoder<u64>>(bytes, ops, COL_REF_CTR)
+    };
+    pred_num = col_iter<RleDecoder<usize>>(bytes, ops, COL_PRED_NUM);
+    pred_actor = col_iter<RleDecoder<usize>>(bytes, ops, COL_PRED_ACTOR);
+    pred_ctr = col_iter<DeltaDecoder>(bytes, ops, COL_PRED_CTR);
+}
+
+std::optional<std::pair<ObjId, Op>> ChangeOpIterator::next() {
+    auto action_next = action.next();
+    if (!action_next.has_value() || !(*action_next).has_value()) {
+        return {};
+    }
+    auto insert_next = insert.next();
+    if (!insert_next.has_value()) {
+        return {};
+    }
+    auto obj = next_obj();
+    if (!obj.has_value()) {
+        return {};
+    }
+    auto key = next_key();
+    if (!key.has_value()) {
+        return {};
+    }
+    auto pred = next_pred();
+    if (!pred.has_value()) {
+        return {};
+    }
+    auto value_next = value.next();
+    if (!value_next.has_value()) {
+        return {};
+    }
+
+    auto act = action_to_op_type(**action_next, std::move(*value_next));
+    if (!act.has_value()) {
+        return {};
+    }
+
+    return std::make_pair(
+        std::move(*obj),
+        Op{
+            OpId{ counter++, author },
+            std::move(*act),
+            std::move(*key),
+            {},
+            std::move(*pred),
+            *insert_next
+        });
+}
+
+std::optional<ObjId> ChangeOpIterator::next_obj() {
+    auto actor_next = obj_actor.next();
+    if (!actor_next.has_value()) {
+        return {};
+    }
+    auto ctr_next = obj_ctr.next();
+    if (!ctr_next.has_value()) {
+        return {};
+    }
+
+    if (!(*actor_next).has_value() || !(*ctr_next).has_value()) {
+        return ROOT;
+    }
+
+    auto actor = import_actor(*actor_next);
+    if (!actor.has_value()) {
+        return {};
+    }
+
+    return ObjId{ **ctr_next, *actor };
+}
+
+std::optional<Key> ChangeOpIterator::next_key() {
+    auto actor_next = key_actor.next();
+    if (!actor_next.has_value()) {
+        return {};
+    }
+    auto ctr_next = key_ctr.next();
+    if (!ctr_next.has_value()) {
+        return {};
+    }
+    auto str_next = key_str.next();
+    if (!str_next.has_value()) {
+        return {};
+    }
+
+    if (!(*actor_next).has_value() && !(*ctr_next).has_value() && (*str_next).has_value()) {
+        auto& str = **str_next;
+        if (!last_key.has_value() || last_key->second != str.second ||
+            !std::equal(str.first, str.first + str.second, last_key->first)) {
+            last_prop = m->import_prop(std::string_view((const char*)&(*str.first), str.second));
+            last_key = str;
+        }
+        return Key{ Key::Map, last_prop };
+    }
+
+    if (!(*actor_next).has_value() && (*ctr_next).has_value() && !(*str_next).has_value() && **ctr_next == 0) {
+        return Key{ Key::Seq, HEAD };
+    }
+
+    if ((*actor_next).has_value() && (*ctr_next).has_value() && !(*str_next).has_value()) {
+        auto actor = import_actor(*actor_next);
+        if (!actor.has_value()) {
+            return {};
+        }
+        return Key{ Key::Seq, ElemId{ **ctr_next, *actor } };
+    }
+
+    return {};
+}
+
+std::optional<OpIds> ChangeOpIterator::next_pred() {
+    auto num = pred_num.next();
+    if (!num.has_value() || !(*num).has_value()) {
+        return {};
+    }
+
+    std::vector<OpId> p;
+    p.reserve(**num);
+    for (usize i = 0; i < **num; i++) {
+        auto actor_next = pred_actor.next();
+        if (!actor_next.has_value()) {
+            return {};
+        }
+        auto actor = import_actor(*actor_next);
+        if (!actor.has_value()) {
+            return {};
+        }
+        auto ctr = pred_ctr.next();
+        if (!ctr.has_value() || !(*ctr).has_value()) {
+            return {};
+        }
+
+        p.push_back({ **ctr, *actor });
+    }
+
+    return m->sorted_opids(std::move(p));
+}
+
 DocOpIterator::DocOpIterator(const BinSlice& bytes, const std::vector<ActorId>& actors,
     const std::unordered_map<u32, Range>& ops) {
     actor = col_iter<RleDecoder<usize>>(bytes, ops, COL_ID_ACTOR);
@@ -448,42 +608,15 @@ std::optional<DocOp> DocOpIterator::next() {
         return {};
     }
 
-    OpType act;
-    switch (**action_next) {
-    case Action::Set:
-        act = { OpType::Put, std::move(*value_next) };
-        break;
-    case Action::MakeList:
-        act = { OpType::Make, ObjType::List };
-        break;
-    case Action::MakeText:
-        act = { OpType::Make, ObjType::Text };
-        break;
-    case Action::MakeMap:
-        act = { OpType::Make, ObjType::Map };
-        break;
-    case Action::MakeTable:
-        act = { OpType::Make, ObjType::Table };
-        break;
-    case Action::Del:
-        act = { OpType::Delete };
-        break;
-    case Action::Inc: {
-        auto num = value_next->to_s64();
-        if (!num.has_value()) {
-            return {};
-        }
-        act = { OpType::Increment, *num };
-        break;
-    }
-    default:
-        break;
+    auto act = action_to_op_type(**action_next, std::move(*value_next));
+    if (!act.has_value()) {
+        return {};
     }
 
     return DocOp{
         **actor_next,
         **ctr_next,
-        std::move(act),
+        std::move(*act),
         std::move(*obj),
         std::move(*key),
         std::move(*succ_next),
@@ -854,14 +987,27 @@ std::vector<ColData> ObjEncoderOld::finish() {
 
 /////////////////////////////////////////////////////////
 
-void ChangeEncoder::encode(const std::vector<Change>& changes, const IndexedCache<ActorId>& actors) {
+ColumnLayout ChangeEncoder::encode_changes(const History& changes, const IndexedCache<ActorId>& actors) {
+    ChangeEncoder e;
+
+    e.reserve(changes.size());
+    e.encode(changes, actors);
+    return e.finish();
+}
+
+void ChangeEncoder::reserve(usize num_changes) {
+    // the time of each change is almost never a run
+    time.reserve(num_changes * 2);
+}
+
+void ChangeEncoder::encode(const History& changes, const IndexedCache<ActorId>& actors) {
     std::unordered_map<ChangeHash, usize> index_by_hash;
     for (usize index = 0; index < changes.size(); ++index) {
         auto& change = changes[index];
         index_by_hash.insert({ change.hash, index });
         actor.append_value(actors.lookup(change.actor_id()).value());
         seq.append_value(change.seq);
-        max_op.append_value(change.start_op + change.iter_ops().count() - 1);
+        max_op.append_value(change.max_op());
         time.append_value((u64)change.time);
         message.append_value(change.get_message());
         deps_num.append_value(change.deps.size());
@@ -883,141 +1029,114 @@ void ChangeEncoder::encode(const std::vector<Change>& changes, const IndexedCach
     }
 }
 
-std::pair<std::vector<u8>, std::vector<u8>> ChangeEncoder::finish() {
-    std::vector<ColData> coldata{
-        actor.finish(DOC_ACTOR),
-        seq.finish(DOC_SEQ),
-        max_op.finish(DOC_MAX_OP),
-        time.finish(DOC_TIME),
-        message.finish(DOC_MESSAGE),
-        deps_num.finish(DOC_DEPS_NUM),
-        deps_index.finish(DOC_DEPS_INDEX),
-        extra_len.finish(DOC_EXTRA_LEN),
-        ColData{ DOC_EXTRA_RAW, std::move(extra_raw), false }
-    };
-    std::sort(coldata.begin(), coldata.end());
-
-    std::vector<u8> data;
-    std::vector<u8> info;
-    Encoder encoder(info);
-
-    usize non_empty_data_count = std::count_if(coldata.begin(), coldata.end(), [](const ColData& d) {
-        return !(d.data.empty());
-        });
-    encoder.encode(non_empty_data_count);
-
-    usize len = 0;
-    for (auto& d : coldata) {
-        d.deflate();
-        d.encode_col_len(encoder);
-
-        len += d.data.size();
-    }
-
-    data.reserve(len);
-    for (auto& d : coldata) {
-        vector_extend(data, std::move(d.data));
-    }
-
-    return { std::move(data), std::move(info) };
+ColumnLayout ChangeEncoder::finish() {
+    ColumnLayout layout;
+    layout.columns.reserve(9);
+    layout.append(actor.finish(DOC_ACTOR));
+    layout.append(seq.finish(DOC_SEQ));
+    layout.append(max_op.finish(DOC_MAX_OP));
+    layout.append(time.finish(DOC_TIME));
+    layout.append(message.finish(DOC_MESSAGE));
+    layout.append(deps_num.finish(DOC_DEPS_NUM));
+    layout.append(deps_index.finish(DOC_DEPS_INDEX));
+    layout.append(extra_len.finish(DOC_EXTRA_LEN));
+    layout.append(ColData{ DOC_EXTRA_RAW, std::move(extra_raw), false });
+    layout.finish(true);
+
+    return layout;
 }
 
 /////////////////////////////////////////////////////////
 
-void DocOpEncoder::encode(OpSetIter& ops, const std::vector<usize>& actors, const std::vector<std::string_view>& props) {
+void DocOpEncoder::reserve(usize num_ops) {
+    // one byte per op for the value metadata, the raw values and the successor counts
+    val.len.reserve(num_ops);
+    val.raw.reserve(num_ops);
+    succ.num.reserve(num_ops);
+}
+
+void DocOpEncoder::encode(OpSetIter& ops, const std::vector<std::pair<ObjId, Op>>& collected,
+    const std::vector<usize>& actors, const std::vector<std::string_view>& props)
+{
     while (true) {
         auto ops_next = ops.next();
         if (!ops_next.has_value()) {
             break;
         }
-        auto obj = ops_next->first;
-        auto op = ops_next->second;
+        append(*ops_next->first, *ops_next->second, actors, props);
+    }
 
-        usize actor_index = actors[op->id.actor];
-        actor.append_value(std::move(actor_index));
-        ctr.append_value(op->id.counter);
-        this->obj.append(*obj, actors);
-        key.append(Key(op->key), actors, props);
-        insert.append(op->insert);
-        succ.append(op->succ.v, actors);
-
-        Action action;
-        auto& op_action = op->action;
-        switch (op_action.tag) {
-        case OpType::Put:
-            val.append_value(std::get<ScalarValue>(op_action.data), actors);
-            action = Action::Set;
+    // the loader regroups the ops by change, so the collected ops need not be in tree order
+    for (auto& [obj, op] : collected) {
+        append(obj, op, actors, props);
+    }
+}
+
+void DocOpEncoder::append(const ObjId& obj, const Op& op, const std::vector<usize>& actors,
+    const std::vector<std::string_view>& props)
+{
+    usize actor_index = actors[op.id.actor];
+    actor.append_value(std::move(actor_index));
+    ctr.append_value(op.id.counter);
+    this->obj.append(obj, actors);
+    key.append(Key(op.key), actors, props);
+    insert.append(op.insert);
+    succ.append(op.succ.v, actors);
+
+    Action action = Action::MakeMap;
+    auto& op_action = op.action;
+    switch (op_action.tag) {
+    case OpType::Put:
+        val.append_value(std::get<ScalarValue>(op_action.data), actors);
+        action = Action::Set;
+        break;
+    case OpType::Increment:
+        val.append_value(ScalarValue{ ScalarValue::Int, std::get<s64>(op_action.data) }, actors);
+        action = Action::Inc;
+        break;
+    case OpType::Delete:
+        val.append_null();
+        action = Action::Del;
+        break;
+    case OpType::Make:
+        val.append_null();
+        switch (std::get<ObjType>(op_action.data)) {
+        case ObjType::Map:
+            action = Action::MakeMap;
             break;
-        case OpType::Increment:
-            val.append_value(ScalarValue{ ScalarValue::Int, std::get<s64>(op_action.data) }, actors);
-            action = Action::Inc;
+        case ObjType::Table:
+            action = Action::MakeTable;
             break;
-        case OpType::Delete:
-            val.append_null();
-            action = Action::Del;
+        case ObjType::List:
+            action = Action::MakeList;
             break;
-        case OpType::Make:
-            val.append_null();
-            switch (std::get<ObjType>(op_action.data)) {
-            case ObjType::Map:
-                action = Action::MakeMap;
-                break;
-            case ObjType::Table:
-                action = Action::MakeTable;
-                break;
-            case ObjType::List:
-                action = Action::MakeList;
-                break;
-            case ObjType::Text:
-                action = Action::MakeText;
-                break;
-            default:
-                break;
-            }
+        case ObjType::Text:
+            action = Action::MakeText;
             break;
         default:
             break;
         }
-        this->action.append_value(std::move(action));
+        break;
+    default:
+        break;
     }
+    this->action.append_value(std::move(action));
 }
 
-std::pair<std::vector<u8>, std::vector<u8>> DocOpEncoder::finish() {
-    std::vector<ColData> coldata{
-        actor.finish(COL_ID_ACTOR),
-        ctr.finish(COL_ID_CTR),
-        insert.finish(COL_INSERT),
-        action.finish(COL_ACTION)
-    };
-    vector_extend(coldata, obj.finish());
-    vector_extend(coldata, key.finish());
-    vector_extend(coldata, val.finish());
-    vector_extend(coldata, succ.finish());
-    std::sort(coldata.begin(), coldata.end());
-
-    std::vector<u8> info;
-    std::vector<u8> data;
-    Encoder encoder(info);
-
-    usize non_empty_data_count = std::count_if(coldata.begin(), coldata.end(), [](const ColData& d) {
-        return !(d.data.empty());
-        });
-    encoder.encode(non_empty_data_count);
-
-    usize len = 0;
-    for (auto& d : coldata) {
-        d.deflate();
-        d.encode_col_len(encoder);
-
-        len += d.data.size();
-    }
-
-    data.reserve(len);
-    for (auto& d : coldata) {
-        vector_extend(data, std::move(d.data));
-    }
-
-    return { std::move(data), std::move(info) };
+ColumnLayout DocOpEncoder::finish() {
+    ColumnLayout layout;
+    layout.columns.reserve(4 + obj.COLUMNS + key.COLUMNS + val.COLUMNS + succ.COLUMNS);
+    layout.append(actor.finish(COL_ID_ACTOR));
+    layout.append(ctr.finish(COL_ID_CTR));
+    layout.append(insert.finish(COL_INSERT));
+    layout.append(action.finish(COL_ACTION));
+    layout.append(obj.finish());
+    layout.append(key.finish());
+    layout.append(val.finish());
+    layout.append(succ.finish());
+    layout.finish(true);
+
+    return layout;
 }
 
 void ColumnEncoder::append(OldOp&& op, const std::vector<ActorId>& actors) {
@@ -1067,39 +1186,27 @@ void ColumnEncoder::append(OldOp&& op, const std::vector<ActorId>& actors) {
 }
 
 auto ColumnEncoder::finish()->std::pair<std::vector<u8>, std::unordered_map<u32, Range>> {
-    std::vector<ColData> coldata;
-    coldata.reserve(2 + obj.COLUMNS + key.COLUMNS + val.COLUMNS + pred.COLUMNS);
-    coldata.push_back(insert.finish(COL_INSERT));
-    coldata.push_back(action.finish(COL_ACTION));
-    vector_extend(coldata, obj.finish());
-    vector_extend(coldata, key.finish());
-    vector_extend(coldata, val.finish());
-    vector_extend(coldata, pred.finish());
-    std::sort(coldata.begin(), coldata.end());
-
-    usize non_empty_column_count = std::count_if(coldata.begin(), coldata.end(), [](const ColData& d) {
-        return !(d.data.empty());
-        });
-    usize data_len = std::accumulate(coldata.begin(), coldata.end(), usize(0), [](usize sum, const ColData& d) {
-        return sum + d.data.size();
-        });
-    // 1 for the non_empty_column_count, 2 for each non_empty column (encode_col_len), data_len
-    //   for all the actual data
+    ColumnLayout layout;
+    layout.columns.reserve(2 + obj.COLUMNS + key.COLUMNS + val.COLUMNS + pred.COLUMNS);
+    layout.append(insert.finish(COL_INSERT));
+    layout.append(action.finish(COL_ACTION));
+    layout.append(obj.finish());
+    layout.append(key.finish());
+    layout.append(val.finish());
+    layout.append(pred.finish());
+    layout.finish(false);
+
     std::vector<u8> data;
-    data.reserve(1 + non_empty_column_count * 2 + data_len);
+    data.reserve(layout.info_len() + layout.data_len());
     Encoder encoder(data);
-
-    encoder.encode(non_empty_column_count);
-    for (auto& d : coldata) {
-        d.encode_col_len(encoder);
-    }
+    layout.write_info(encoder);
 
     std::unordered_map<u32, Range> rangemap;
-    rangemap.reserve(non_empty_column_count);
-    for (auto& d : coldata) {
+    rangemap.reserve(layout.non_empty_count());
+    for (auto& d : layout.columns) {
         if (!d.data.empty()) {
             usize begin = data.size();
-            vector_extend(data, std::move(d.data));
+            data.insert(data.end(), d.data.cbegin(), d.data.cend());
             rangemap.insert({ d.col, { begin, data.size() } });
         }
     }
@@ -142,6 +142,53 @@ struct OperationIterator {
     usize count();
 };
 
+// Decodes the ops of a change straight into internal `Op`s. The actor table of the change is mapped
+// to document actor indices once, and map keys are borrowed from the change and interned once per
+// distinct key, so no `OldOp`, `ActorId` or key string is built per op.
+struct ChangeOpIterator {
+    OpSetMetadata* m = nullptr;
+    // change actor index -> document actor index
+    std::vector<usize> actors;
+    u64 counter = 0;
+    usize author = 0;
+
+    RleDecoder<Action> action;
+    BooleanDecoder insert;
+    RleDecoder<usize> obj_actor;
+    RleDecoder<u64> obj_ctr;
+    RleDecoder<usize> key_actor;
+    DeltaDecoder key_ctr;
+    RleDecoder<BinSlice> key_str;
+    ValueIterator value;
+    RleDecoder<usize> pred_num;
+    RleDecoder<usize> pred_actor;
+    DeltaDecoder pred_ctr;
+
+    // consecutive ops usually share their key
+    std::optional<BinSlice> last_key;
+    usize last_prop = 0;
+
+    ChangeOpIterator() = delete;
+    ChangeOpIterator(const BinSlice& bytes, const std::vector<ActorId>& change_actors,
+        const std::unordered_map<u32, Range>& ops, u64 start_op, OpSetMetadata& meta);
+
+    std::optional<std::pair<ObjId, Op>> next();
+
+private:
+    std::optional<usize> import_actor(const std::optional<usize>& change_actor) const {
+        if (!change_actor.has_value() || *change_actor >= actors.size()) {
+            return {};
+        }
+        return actors[*change_actor];
+    }
+
+    std::optional<ObjId> next_obj();
+
+    std::optional<Key> next_key();
+
+    std::optional<OpIds> next_pred();
+};
+
 struct DocOp {
     usize actor = 0;
     u64 ctr = 0;
@@ -249,6 +296,8 @@ struct SuccEncoder {
     RleEncoder<usize> actor = {};
     DeltaEncoder ctr = {};
 
+    const usize COLUMNS = 3;
+
     void append(const std::vector<OpId>& succ, const std::vector<usize>& actors);
 
     void append_old(const std::vector<OpId>& succ);
@@ -291,6 +340,7 @@ struct ObjEncoderOld {
 };
 
 struct Change;
+class History;
 
 struct ChangeEncoder {
     RleEncoder<usize> actor = {};
@@ -303,17 +353,14 @@ struct ChangeEncoder {
     RleEncoder<usize> extra_len = {};
     std::vector<u8> extra_raw = {};
 
-    static auto encode_changes(const std::vector<Change>& changes, const IndexedCache<ActorId>& actors)
-        -> std::pair<std::vector<u8>, std::vector<u8>> {
-        ChangeEncoder e;
+    static ColumnLayout encode_changes(const History& changes, const IndexedCache<ActorId>& actors);
 
-        e.encode(changes, actors);
-        return e.finish();
-    }
+    // Size hint for the columns that grow with every change.
+    void reserve(usize num_changes);
 
-    void encode(const std::vector<Change>& changes, const IndexedCache<ActorId>& actors);
+    void encode(const History& changes, const IndexedCache<ActorId>& actors);
 
-    auto finish() -> std::pair<std::vector<u8>, std::vector<u8>>;
+    ColumnLayout finish();
 };
 
 struct DocOpEncoder {
@@ -326,18 +373,26 @@ struct DocOpEncoder {
     ValEncoder val = {};
     SuccEncoder succ = {};
 
-    static auto encode_doc_ops(OpSetIter& ops, const std::vector<usize>& actors,
-        const std::vector<std::string_view>& props) -> std::pair<std::vector<u8>, std::vector<u8>>
+    static ColumnLayout encode_doc_ops(OpSetIter& ops, const std::vector<std::pair<ObjId, Op>>& collected,
+        const std::vector<usize>& actors, const std::vector<std::string_view>& props, usize num_ops)
     {
         DocOpEncoder e;
 
-        e.encode(ops, actors, props);
+        e.reserve(num_ops);
+        e.encode(ops, collected, actors, props);
         return e.finish();
     }
 
-    void encode(OpSetIter& ops, const std::vector<usize>& actors, const std::vector<std::string_view>& props);
+    // Size hint for the columns that rarely collapse into runs.
+    void reserve(usize num_ops);
+
+    void encode(OpSetIter& ops, const std::vector<std::pair<ObjId, Op>>& collected,
+        const std::vector<usize>& actors, const std::vector<std::string_view>& props);
+
+    void append(const ObjId& obj, const Op& op, const std::vector<usize>& actors,
+        const std::vector<std::string_view>& props);
 
-    auto finish() -> std::pair<std::vector<u8>, std::vector<u8>>;
+    ColumnLayout finish();
 };
 
 struct ColumnEncoder {
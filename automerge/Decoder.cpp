@@ -65,6 +65,19 @@ void Decoding::decode(BinSlice& bytes, std::optional<std::vector<u8>>& val) {
     delete[]buffer;
 }
 
+void Decoding::decode(BinSlice& bytes, std::optional<BinSlice>& val) {
+    std::optional<usize> len;
+    decode_usize(bytes, len);
+    if (!len.has_value() || *len > bytes.second) {
+        val.reset();
+        return;
+    }
+
+    val = BinSlice{ bytes.first, *len };
+    bytes.first += *len;
+    bytes.second -= *len;
+}
+
 void Decoding::decode(BinSlice& bytes, std::optional<std::string>& val) {
     std::optional<std::vector<u8>> result;
     decode(bytes, result);
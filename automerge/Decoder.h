@@ -53,6 +53,9 @@ public:
 
     static void decode(BinSlice& bytes, std::optional<std::vector<u8>>& val);
 
+    // Length prefixed bytes, borrowed from `bytes` instead of copied.
+    static void decode(BinSlice& bytes, std::optional<BinSlice>& val);
+
     static void decode(BinSlice& bytes, std::optional<std::string>& val);
 
     static void decode(BinSlice& bytes, std::optional<std::string_view>& val);
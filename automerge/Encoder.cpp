@@ -2,13 +2,15 @@
 // This code is licensed under MIT license (see LICENSE for details)
 
 #include <cassert>
+#include <algorithm>
+#include <numeric>
 
 #include "Encoder.h"
 #include "leb128.h"
 #include "helper.h"
 
 usize Encoder::encode(const std::string_view& val) {
-    out_buf.reserve(out_buf.size() + LEB128_U64_MAX_BYTE_SIZE + val.size());
+    reserve_more(LEB128_U64_MAX_BYTE_SIZE + val.size());
 
     usize head = encode(val.size());
     out_buf.insert(out_buf.end(), val.begin(), val.end());
@@ -17,7 +19,7 @@ usize Encoder::encode(const std::string_view& val) {
 }
 
 usize Encoder::encode(const std::string& val) {
-    out_buf.reserve(out_buf.size() + LEB128_U64_MAX_BYTE_SIZE + val.size());
+    reserve_more(LEB128_U64_MAX_BYTE_SIZE + val.size());
 
     usize head = encode(val.size());
     out_buf.insert(out_buf.end(), val.begin(), val.end());
@@ -28,7 +30,7 @@ usize Encoder::encode(const std::string& val) {
 usize Encoder::encode(const std::vector<ActorId>& val, usize skip) {
     assert(skip <= val.size());
 
-    out_buf.reserve(out_buf.size() + LEB128_U64_MAX_BYTE_SIZE + (val.size() - skip) * ACTOR_ID_SIZE);
+    reserve_more(LEB128_U64_MAX_BYTE_SIZE + (val.size() - skip) * ACTOR_ID_SIZE);
 
     usize len = encode(val.size() - skip);
     for (auto iter = val.cbegin() + skip; iter != val.cend(); ++iter) {
@@ -39,7 +41,7 @@ usize Encoder::encode(const std::vector<ActorId>& val, usize skip) {
 }
 
 usize Encoder::encode(const ActorId& val) {
-    out_buf.reserve(out_buf.size() + 1 + ACTOR_ID_SIZE);
+    reserve_more(1 + ACTOR_ID_SIZE);
 
     usize len = ACTOR_ID_SIZE;
     usize head = encode(len);
@@ -49,7 +51,7 @@ usize Encoder::encode(const ActorId& val) {
 }
 
 usize Encoder::encode(const std::vector<u8>& val) {
-    out_buf.reserve(out_buf.size() + LEB128_U64_MAX_BYTE_SIZE + val.size());
+    reserve_more(LEB128_U64_MAX_BYTE_SIZE + val.size());
 
     usize head = encode(val.size());
     vector_extend(out_buf, val);
@@ -58,7 +60,7 @@ usize Encoder::encode(const std::vector<u8>& val) {
 }
 
 usize Encoder::encode(const BinSlice& val) {
-    out_buf.reserve(out_buf.size() + LEB128_U64_MAX_BYTE_SIZE + val.second);
+    reserve_more(LEB128_U64_MAX_BYTE_SIZE + val.second);
 
     usize head = encode(val.second);
     out_buf.insert(out_buf.end(), val.first, val.first + val.second);
@@ -67,7 +69,7 @@ usize Encoder::encode(const BinSlice& val) {
 }
 
 usize Encoder::encode(const std::vector<ChangeHash>& val) {
-    out_buf.reserve(out_buf.size() + LEB128_U64_MAX_BYTE_SIZE + val.size() * HASH_SIZE);
+    reserve_more(LEB128_U64_MAX_BYTE_SIZE + val.size() * HASH_SIZE);
 
     usize head = encode(val.size());
     usize body = 0;
@@ -153,6 +155,53 @@ void ColData::deflate() {
 
 /////////////////////////////////////////////////////////
 
+void ColumnLayout::finish(bool deflate) {
+    std::sort(columns.begin(), columns.end());
+
+    if (deflate) {
+        for (auto& d : columns) {
+            d.deflate();
+        }
+    }
+}
+
+usize ColumnLayout::non_empty_count() const {
+    return std::count_if(columns.cbegin(), columns.cend(), [](const ColData& d) {
+        return !(d.data.empty());
+        });
+}
+
+usize ColumnLayout::info_len() const {
+    usize len = unsigned_leb128_len(non_empty_count());
+    for (auto& d : columns) {
+        if (!d.data.empty()) {
+            len += unsigned_leb128_len(d.col) + unsigned_leb128_len(d.data.size());
+        }
+    }
+    return len;
+}
+
+usize ColumnLayout::data_len() const {
+    return std::accumulate(columns.cbegin(), columns.cend(), usize(0), [](usize sum, const ColData& d) {
+        return sum + d.data.size();
+        });
+}
+
+void ColumnLayout::write_info(Encoder& encoder) const {
+    encoder.encode(non_empty_count());
+    for (auto& d : columns) {
+        d.encode_col_len(encoder);
+    }
+}
+
+void ColumnLayout::write_data(std::vector<u8>& out) const {
+    for (auto& d : columns) {
+        out.insert(out.end(), d.data.cbegin(), d.data.cend());
+    }
+}
+
+/////////////////////////////////////////////////////////
+
 void BooleanEncoder::append(bool value) {
     if (value == last) {
         ++count;
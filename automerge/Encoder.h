@@ -3,7 +3,9 @@
 
 #pragma once
 
+#include <algorithm>
 #include <optional>
+#include <vector>
 #include <type_traits>
 
 #include "type.h"
@@ -91,6 +93,14 @@ public:
 private:
     std::vector<u8>& out_buf;
 
+    // Grow the buffer geometrically, an exact `reserve` per value would make appending quadratic.
+    void reserve_more(usize additional) {
+        usize required = out_buf.size() + additional;
+        if (required > out_buf.capacity()) {
+            out_buf.reserve(std::max(required, out_buf.capacity() * 2));
+        }
+    }
+
     usize write_unsigned(u64 val);
 
     usize write_signed(s64 val);
@@ -110,18 +120,49 @@ struct ColData {
     void deflate();
 };
 
+// The finished columns of a chunk, laid out in column order. Each column is still encoded into a
+// vector of its own, since the encoders append to every column per op and cannot share one
+// growing buffer. What the layout saves is the intermediate info and data vectors: knowing their
+// exact sizes, the chunk is allocated once and each column is copied into it once.
+struct ColumnLayout {
+    std::vector<ColData> columns;
+
+    void append(ColData&& column) {
+        columns.push_back(std::move(column));
+    }
+
+    void append(std::vector<ColData>&& cols) {
+        for (auto& column : cols) {
+            columns.push_back(std::move(column));
+        }
+    }
+
+    // Sort the columns by id and deflate the large ones.
+    void finish(bool deflate);
+
+    usize non_empty_count() const;
+
+    // The exact size of the encoded column info.
+    usize info_len() const;
+
+    usize data_len() const;
+
+    void write_info(Encoder& encoder) const;
+
+    void write_data(std::vector<u8>& out) const;
+};
+
 template <class T>
 struct RleState {
     enum {
         EMPTY,
         NULL_RUN,       // usize
-        LITERAL_RUN,    // T, Vec<T>
+        LITERAL_RUN,    // T, usize
         LONE_VAL,       // T
         RUN             // T, usize
     } tag = EMPTY;
-    usize size = 0;
+    usize size = 0;     // the run length, or the number of values already in the literal buffer
     T value = {};
-    std::vector<T> vec_value = {};
 };
 
 template <class T>
@@ -129,6 +170,14 @@ struct RleEncoder {
     std::vector<u8> buf;
     RleState<T> state;
     Encoder encoder = Encoder(buf);
+    // Values of the current literal run are encoded here as they arrive, and copied behind the run
+    // header on flush. The buffer keeps its capacity, so literal runs cost no allocation.
+    std::vector<u8> lit_buf;
+    Encoder lit_encoder = Encoder(lit_buf);
+
+    void reserve(usize size_hint) {
+        buf.reserve(size_hint);
+    }
 
     ColData finish(u32 col) {
         switch (state.tag) {
@@ -138,14 +187,15 @@ struct RleEncoder {
             }
             break;
         case RleState<T>::LONE_VAL:
-            flush_lit_run({ std::move(state.value) });
+            lit_encoder.encode(state.value);
+            flush_lit_run(1);
             break;
         case RleState<T>::RUN:
             flush_run(state.value, state.size);
             break;
         case RleState<T>::LITERAL_RUN:
-            state.vec_value.push_back(std::move(state.value));
-            flush_lit_run(std::move(state.vec_value));
+            lit_encoder.encode(state.value);
+            flush_lit_run(state.size + 1);
             break;
         case RleState<T>::EMPTY:
             break;
@@ -166,33 +216,33 @@ struct RleEncoder {
         encoder.encode(len);
     }
 
-    void flush_lit_run(std::vector<T>&& run) {
-        encoder.encode(-((s64)run.size()));
-        for (const auto& val : run) {
-            encoder.encode(val);
-        }
+    void flush_lit_run(usize len) {
+        encoder.encode(-((s64)len));
+        buf.insert(buf.end(), lit_buf.cbegin(), lit_buf.cend());
+        lit_buf.clear();
     }
 
     void append_null() {
         switch (state.tag) {
         case RleState<T>::EMPTY:
-            state = RleState<T>{ RleState<T>::NULL_RUN, 1, {}, {} };
+            state = RleState<T>{ RleState<T>::NULL_RUN, 1, {} };
             break;
         case RleState<T>::NULL_RUN:
             state.size += 1;
             break;
         case RleState<T>::LONE_VAL:
-            flush_lit_run({ std::move(state.value) });
-            state = RleState<T>{ RleState<T>::NULL_RUN, 1, {}, {} };
+            lit_encoder.encode(state.value);
+            flush_lit_run(1);
+            state = RleState<T>{ RleState<T>::NULL_RUN, 1, {} };
             break;
         case RleState<T>::RUN:
             flush_run(state.value, state.size);
-            state = RleState<T>{ RleState<T>::NULL_RUN, 1, {}, {} };
+            state = RleState<T>{ RleState<T>::NULL_RUN, 1, {} };
             break;
         case RleState<T>::LITERAL_RUN:
-            state.vec_value.push_back(std::move(state.value));
-            flush_lit_run(std::move(state.vec_value));
-            state = RleState<T>{ RleState<T>::NULL_RUN, 1, {}, {} };
+            lit_encoder.encode(state.value);
+            flush_lit_run(state.size + 1);
+            state = RleState<T>{ RleState<T>::NULL_RUN, 1, {} };
             break;
         default:
             break;
@@ -202,16 +252,15 @@ struct RleEncoder {
     void append_value(T&& value) {
         switch (state.tag) {
         case RleState<T>::EMPTY:
-            state = RleState<T>{ RleState<T>::LONE_VAL, 0, std::move(value), {} };
+            state = RleState<T>{ RleState<T>::LONE_VAL, 0, std::move(value) };
             break;
         case RleState<T>::LONE_VAL:
             if (state.value == value) {
-                state = RleState<T>{ RleState<T>::RUN, 2, std::move(value), {} };
+                state = RleState<T>{ RleState<T>::RUN, 2, std::move(value) };
             }
             else {
-                std::vector<T> v;
-                v.push_back(std::move(state.value));
-                state = RleState<T>{ RleState<T>::LITERAL_RUN, 0, std::move(value), std::move(v) };
+                lit_encoder.encode(state.value);
+                state = RleState<T>{ RleState<T>::LITERAL_RUN, 1, std::move(value) };
             }
             break;
         case RleState<T>::RUN:
@@ -220,22 +269,23 @@ struct RleEncoder {
             }
             else {
                 flush_run(state.value, state.size);
-                state = RleState<T>{ RleState<T>::LONE_VAL, 0, std::move(value), {} };
+                state = RleState<T>{ RleState<T>::LONE_VAL, 0, std::move(value) };
             }
             break;
         case RleState<T>::LITERAL_RUN:
             if (state.value == value) {
-                flush_lit_run(std::move(state.vec_value));
-                state = RleState<T>{ RleState<T>::RUN, 2, std::move(value), {} };
+                flush_lit_run(state.size);
+                state = RleState<T>{ RleState<T>::RUN, 2, std::move(value) };
             }
             else {
-                state.vec_value.push_back(std::move(state.value));
+                lit_encoder.encode(state.value);
+                state.size += 1;
                 state.value = std::move(value);
             }
             break;
         case RleState<T>::NULL_RUN:
             flush_null_run(state.size);
-            state = RleState<T>{ RleState<T>::LONE_VAL, 0, std::move(value), {} };
+            state = RleState<T>{ RleState<T>::LONE_VAL, 0, std::move(value) };
             break;
         default:
             break;
@@ -249,6 +299,10 @@ struct  BooleanEncoder {
     usize count = 0;
     Encoder encoder = Encoder(buf);
 
+    void reserve(usize size_hint) {
+        buf.reserve(size_hint);
+    }
+
     void append(bool value);
 
     ColData finish(u32 col);
@@ -258,6 +312,10 @@ struct DeltaEncoder {
     RleEncoder<s64> rle;
     u64 absolute_value = 0;
 
+    void reserve(usize size_hint) {
+        rle.reserve(size_hint);
+    }
+
     void append_value(u64 value) {
         rle.append_value((s64)value - (s64)absolute_value);
         absolute_value = value;
@@ -26,6 +26,7 @@ struct  AutomergeError {
         InvalidHash, //(ChangeHash),
         MissingHash, //(ChangeHash),
         MissingCounter,
+        GarbageCollected,
         Fail,
     } tag = NotAnObject;
     std::variant<std::string, u64, ActorIdPair, ChangeHash> data = {};
@@ -0,0 +1,92 @@
+// Copyright (c) 2022 the VGG Automerge contributors
+// This code is licensed under MIT license (see LICENSE for details)
+
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <iterator>
+#include <stdexcept>
+
+#include "type.h"
+#include "Change.h"
+
+// The changes of a document in the order they were applied, shared by the document and its forks.
+// The copies share one buffer, and each sees its own prefix of it. A copy whose prefix is the whole
+// buffer appends to it in place, which moves none of the changes, so the prefixes of the other
+// copies stay as they were. Any other write first copies the prefix.
+// Like the op tree, copies that share the buffer must not be written or destroyed concurrently, and
+// an iterator does not outlive a write to any of them.
+class History {
+public:
+    using const_iterator = std::deque<Change>::const_iterator;
+    using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+    usize size() const {
+        return length;
+    }
+
+    bool empty() const {
+        return length == 0;
+    }
+
+    const Change& operator[](usize index) const {
+        return (*changes)[index];
+    }
+
+    // throw std::out_of_range
+    const Change& at(usize index) const {
+        if (index >= length) {
+            throw std::out_of_range("history index out of range");
+        }
+        return (*changes)[index];
+    }
+
+    const Change& back() const {
+        return (*changes)[length - 1];
+    }
+
+    const_iterator begin() const {
+        return changes->cbegin();
+    }
+
+    const_iterator end() const {
+        return changes->cbegin() + length;
+    }
+
+    const_reverse_iterator rbegin() const {
+        return const_reverse_iterator(end());
+    }
+
+    const_reverse_iterator rend() const {
+        return const_reverse_iterator(begin());
+    }
+
+    void push_back(Change&& change) {
+        if (changes->size() != length) {
+            own();
+        }
+        changes->push_back(std::move(change));
+        ++length;
+    }
+
+    // The change at `index`, to be written.
+    Change& mut(usize index) {
+        own();
+        return (*changes)[index];
+    }
+
+private:
+    std::shared_ptr<std::deque<Change>> changes = std::make_shared<std::deque<Change>>();
+    usize length = 0;
+
+    // Make the buffer this copy's own, holding just its prefix.
+    void own() {
+        if (changes.use_count() > 1) {
+            changes = std::make_shared<std::deque<Change>>(changes->cbegin(), changes->cbegin() + length);
+        }
+        else {
+            changes->resize(length);
+        }
+    }
+};
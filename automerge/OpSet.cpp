@@ -83,8 +83,8 @@ OpIds OpSetMetadata::import_opids(std::vector<OldOpId>&& external_opids) {
 
 OpSetIter OpSetInternal::iter() const {
     std::vector<std::pair<const ObjId*, const OpTree*>> objs;
-    objs.reserve(trees.size());
-    for (auto& tree : trees) {
+    objs.reserve(trees->size());
+    for (auto& tree : *trees) {
         objs.emplace_back(&tree.first, &tree.second);
     }
 
@@ -97,9 +97,9 @@ OpSetIter OpSetInternal::iter() const {
 }
 
 std::optional<std::pair<ObjId, Key>> OpSetInternal::parent_object(const ObjId& obj) const {
-    if (trees.count(obj) == 0 || !trees.at(obj).parent.has_value())
+    if (trees->count(obj) == 0 || !trees->at(obj).parent.has_value())
         return std::nullopt;
-    auto& parent = *(trees.at(obj).parent);
+    auto& parent = *(trees->at(obj).parent);
     auto query = OpIdSearch(obj);
     auto& key = static_cast<OpIdSearch&>(search(parent, query)).key;
     if (!key.has_value()) {
@@ -120,7 +120,7 @@ Prop OpSetInternal::export_key(const ObjId& obj, const Key& key) const {
 
 std::optional<QueryKeys> OpSetInternal::keys(const ObjId& obj) const {
     try {
-        auto& tree = trees.at(obj);
+        auto& tree = trees->at(obj);
         return tree.internal.keys();
     }
     catch (std::out_of_range&) {
@@ -130,7 +130,7 @@ std::optional<QueryKeys> OpSetInternal::keys(const ObjId& obj) const {
 
 TreeQuery& OpSetInternal::search(const ObjId& obj, TreeQuery& query) const {
     try {
-        auto& tree = trees.at(obj);
+        auto& tree = trees->at(obj);
         return tree.internal.search(query, m);
     }
     catch (std::out_of_range&) {
@@ -140,7 +140,7 @@ TreeQuery& OpSetInternal::search(const ObjId& obj, TreeQuery& query) const {
 
 void OpSetInternal::replace(const ObjId& obj, usize index, OpFunc f) {
     try {
-        auto& tree = trees.at(obj);
+        auto& tree = trees.mut().at(obj);
         tree.internal.update(index, f);
     }
     catch (std::out_of_range&) {
@@ -149,7 +149,7 @@ void OpSetInternal::replace(const ObjId& obj, usize index, OpFunc f) {
 
 void OpSetInternal::add_succ(const ObjId& obj, const std::vector<usize>& op_indices, const Op& op) {
     try {
-        auto& tree = trees.at(obj);
+        auto& tree = trees.mut().at(obj);
         for (auto index : op_indices) {
             tree.internal.update(index, [&](Op& old_op) {
                 old_op.add_succ(op, [&](const OpId& left, const OpId& right) {
@@ -164,18 +164,50 @@ void OpSetInternal::add_succ(const ObjId& obj, const std::vector<usize>& op_indi
 
 Op OpSetInternal::remove(const ObjId& obj, usize index) {
     // this happens on rollback - be sure to go back to the old state
-    auto& tree = trees.at(obj);
+    auto& tree = trees.mut().at(obj);
     --length;
     Op op = tree.internal.remove(index);
     if (op.action.tag == OpType::Make) {
-        trees.erase(op.id);
+        trees.mut().erase(op.id);
     }
     return op;
 }
 
+usize OpSetInternal::remove_if(const std::function<bool(const Op&)>& f) {
+    usize removed = 0;
+    for (auto& [obj, tree] : trees.mut()) {
+        std::vector<const Op*> kept;
+        kept.reserve(tree.len());
+        auto iter = tree.iter();
+        std::optional<const Op*> op;
+        while ((op = iter.next())) {
+            if (!f(**op)) {
+                kept.push_back(*op);
+            }
+            else {
+                collected_ops.mut().emplace_back(obj, **op);
+            }
+        }
+        if (kept.size() == tree.len()) {
+            continue;
+        }
+
+        // inserting in order rebuilds the index of every node
+        OpTreeInternal rebuilt;
+        for (auto op_ptr : kept) {
+            rebuilt.insert(rebuilt.len(), Op(*op_ptr));
+        }
+        removed += tree.len() - kept.size();
+        tree.internal = std::move(rebuilt);
+    }
+    length -= removed;
+
+    return removed;
+}
+
 void OpSetInternal::insert(usize index, const ObjId& obj, Op&& element) {
     if (element.action.tag == OpType::Make) {
-        trees.insert({
+        trees.mut().insert({
             element.id,
             OpTree{
                 OpTreeInternal(),
@@ -186,7 +218,7 @@ void OpSetInternal::insert(usize index, const ObjId& obj, Op&& element) {
     }
 
     try {
-        auto& tree = trees.at(obj);
+        auto& tree = trees.mut().at(obj);
         tree.internal.insert(index, std::move(element));
         ++length;
     }
@@ -298,7 +330,7 @@ void OpSetInternal::insert_op_with_observer(const ObjId& obj, Op&& op, OpObserve
 
 std::optional<ObjType> OpSetInternal::object_type(const ObjId& id) const {
     try {
-        auto& tree = trees.at(id);
+        auto& tree = trees->at(id);
         return std::optional<ObjType>(tree.objtype);
     }
     catch (std::out_of_range&) {
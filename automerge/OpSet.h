@@ -71,6 +71,11 @@ struct OpSetMetadata {
         return g_cache_string(item).first;
     }
 
+    // Intern a prop borrowed from bytes which may not outlive the document.
+    usize import_prop(const std::string_view& item) {
+        return g_cache_string(item).first;
+    }
+
     int key_cmp(const Key& left, const Key& right) const;
 
     int lamport_cmp(const OpId& left, const OpId& right) const;
@@ -96,7 +101,7 @@ public:
     OpSetMetadata m;
 
     OpSetInternal() {
-        trees.insert({ ROOT, OpTree() });
+        trees.mut().insert({ ROOT, OpTree() });
     }
 
     ExId id_to_exid(const OpId& id) const {
@@ -122,10 +127,21 @@ public:
 
     Op remove(const ObjId& obj, usize index);
 
+    // Remove the ops for which `f` returns true from every object, and rebuild the tree of each
+    // object that lost some. The removed ops are moved to `collected`. Returns the number of ops
+    // removed.
+    usize remove_if(const std::function<bool(const Op&)>& f);
+
     usize len() const {
         return length;
     }
 
+    // The ops `remove_if` took out of the trees, with their objects. Queries no longer see them,
+    // but encoding the document still needs them.
+    const std::vector<std::pair<ObjId, Op>>& collected() const {
+        return *collected_ops;
+    }
+
     void insert(usize index, const ObjId& obj, Op&& element);
 
     void insert_op(const ObjId& obj, Op&& op);
@@ -136,9 +152,10 @@ public:
 
 private:
     // The map of objects to their type and ops.
-    std::unordered_map<ObjId, OpTree> trees;
+    CopyOnWrite<std::unordered_map<ObjId, OpTree>> trees;
     // The number of operations in the opset.
     usize length = 0;
+    CopyOnWrite<std::vector<std::pair<ObjId, Op>>> collected_ops;
 };
 
 using OpSet = OpSetInternal;
@@ -10,7 +10,7 @@
 #include "helper.h"
 
 OpTreeIter::OpTreeIter(const OpTreeInternal& tree) {
-    if (!tree.root_node.has_value()) {
+    if (!tree.root_node) {
         is_emtpy = true;
         return;
     }
@@ -19,9 +19,9 @@ OpTreeIter::OpTreeIter(const OpTreeInternal& tree) {
 
     // This is a guess at the average depth of an OpTree
     ancestors.reserve(6);
-    current = { &(*tree.root_node), 0 };
+    current = { tree.root_node.get(), 0 };
     cumulative_index = 0;
-    root_node = &(*tree.root_node);
+    root_node = tree.root_node.get();
 }
 
 std::optional<const Op*> OpTreeIter::next() {
@@ -73,7 +73,7 @@ std::optional<const Op*> OpTreeIter::next() {
         // current nodes `elements`, so we must now descend into a leaf child
         ancestors.push_back(current);
         while (true) {
-            auto& child = current.node->children[current.index];
+            auto& child = *current.node->children[current.index];
             current.index = 0;
             if (!child.is_leaf()) {
                 ancestors.push_back({ &child, 0 });
@@ -111,7 +111,7 @@ std::optional<const Op*> OpTreeIter::nth(usize n) {
     while (!current.node->is_leaf()) {
         auto& children = current.node->children;
         for (usize child_index = 0; child_index < children.size(); ++child_index) {
-            auto& child = children[child_index];
+            auto& child = *children[child_index];
             auto sum = cumulative_index + child.len();
             if (sum < n) {
                 cumulative_index += child.len() + 1;
@@ -159,7 +159,7 @@ bool OpTreeNode::search(TreeQuery& query, const OpSetMetadata& m, std::optional<
     }
 
     for (usize child_index = 0; child_index < children.size(); ++child_index) {
-        auto& child = children[child_index];
+        auto& child = *children[child_index];
         if (!skip.has_value()) {
             // descend and try find it
             auto res = query.query_node_with_metadata(child, m);
@@ -210,27 +210,31 @@ bool OpTreeNode::search(TreeQuery& query, const OpSetMetadata& m, std::optional<
 void OpTreeNode::reindex() {
     Index index;
     for (auto& c : children) {
-        index.merge(c.index);
+        index.merge(c->index);
     }
     for (auto& e : elements) {
         index.insert(e);
     }
-    this->index = index;
+    this->index = std::move(index);
 }
 
 std::pair<usize, usize> OpTreeNode::find_child_index(usize index) const {
     usize cumulative_len = 0;
     for (usize i = 0; i < children.size(); ++i) {
-        if (cumulative_len + children[i].len() >= index) {
+        if (cumulative_len + children[i]->len() >= index) {
             return { i, index - cumulative_len };
         }
         else {
-            cumulative_len += children[i].len() + 1;
+            cumulative_len += children[i]->len() + 1;
         }
     }
     throw std::runtime_error("index not found");
 }
 
+OpTreeNode& OpTreeNode::child_mut(usize child_index) {
+    return make_mut(children[child_index]);
+}
+
 void OpTreeNode::insert_into_non_full_node(usize index, Op&& element) {
     assert(!is_full());
 
@@ -243,17 +247,16 @@ void OpTreeNode::insert_into_non_full_node(usize index, Op&& element) {
     }
 
     auto [child_index, sub_index] = find_child_index(index);
-    auto& child = children[child_index];
 
-    if (child.is_full()) {
+    if (children[child_index]->is_full()) {
         split_child(child_index);
 
         // child structure has changed so we need to find the index again
         auto [child_index, sub_index] = find_child_index(index);
-        children[child_index].insert_into_non_full_node(sub_index, std::move(element));
+        child_mut(child_index).insert_into_non_full_node(sub_index, std::move(element));
     }
     else {
-        child.insert_into_non_full_node(sub_index, std::move(element));
+        child_mut(child_index).insert_into_non_full_node(sub_index, std::move(element));
     }
     ++length;
 }
@@ -262,7 +265,7 @@ void OpTreeNode::split_child(usize full_child_index) {
 #ifndef NDEBUG
     usize original_len_self = len();
 #endif
-    auto& full_child = children[full_child_index];
+    auto& full_child = child_mut(full_child_index);
 
     // Create a new node which is going to store (B-1) keys
     // of the full child.
@@ -282,8 +285,8 @@ void OpTreeNode::split_child(usize full_child_index) {
 
     auto children_len_sum = [](const OpTreeNode& node) {
         return std::accumulate(node.children.cbegin(), node.children.cend(), usize(0),
-            [](usize length, const OpTreeNode& c) {
-                return length + c.len();
+            [](usize length, const std::shared_ptr<OpTreeNode>& c) {
+                return length + c->len();
             });
     };
     full_child.length = full_child.elements.size() + children_len_sum(full_child);
@@ -296,8 +299,9 @@ void OpTreeNode::split_child(usize full_child_index) {
     full_child.reindex();
     successor_sibling.reindex();
 
-    children.insert(std::next(children.begin(), full_child_index + 1), successor_sibling);
-    elements.insert(std::next(elements.begin(), full_child_index), middle);
+    children.insert(std::next(children.begin(), full_child_index + 1),
+        std::make_shared<OpTreeNode>(std::move(successor_sibling)));
+    elements.insert(std::next(elements.begin(), full_child_index), std::move(middle));
 
     assert(full_child_len + z_len + 1 == original_len);
     assert(original_len_self == len());
@@ -310,19 +314,19 @@ Op OpTreeNode::remove_from_leaf(usize index) {
 
 Op OpTreeNode::remove_element_from_non_leaf(usize index, usize element_index) {
     --length;
-    if (children[element_index].elements.size() >= B) {
+    if (children[element_index]->elements.size() >= B) {
         usize total_index = cumulative_index(element_index);
         // recursively delete index - 1 in predecessor_node
-        Op predecessor = children[element_index].remove(index - 1 - total_index);
+        Op predecessor = child_mut(element_index).remove(index - 1 - total_index);
         // replace element with that one
         std::swap(elements[element_index], predecessor);
 
         return predecessor;
     }
-    else if (children[element_index + 1].elements.size() >= B) {
+    else if (children[element_index + 1]->elements.size() >= B) {
         // recursively delete index + 1 in successor_node
         usize total_index = cumulative_index(element_index + 1);
-        Op successor = children[element_index + 1].remove(index + 1 - total_index);
+        Op successor = child_mut(element_index + 1).remove(index + 1 - total_index);
         // replace element with that one
         std::swap(elements[element_index], successor);
 
@@ -330,27 +334,27 @@ Op OpTreeNode::remove_element_from_non_leaf(usize index, usize element_index) {
     }
     else {
         Op middle_element = vector_remove(elements, element_index);
-        OpTreeNode successor_child = vector_remove(children, element_index + 1);
-        children[element_index].merge(std::move(middle_element), successor_child);
+        auto successor_child = vector_remove(children, element_index + 1);
+        child_mut(element_index).merge(std::move(middle_element), make_mut(successor_child));
 
         usize total_index = cumulative_index(element_index);
-        return children[element_index].remove(index - total_index);
+        return child_mut(element_index).remove(index - total_index);
     }
 }
 
 usize OpTreeNode::cumulative_index(usize child_index) const {
     usize sum = 0;
     for_each(children.cbegin(), std::next(children.cbegin(), child_index), [&](auto& c) {
-        sum += c.len() + 1;
+        sum += c->len() + 1;
         });
 
     return sum;
 }
 
 Op OpTreeNode::remove_from_internal_child(usize index, usize child_index) {
-    if ((children[child_index].elements.size() < B) &&
-        (child_index == 0 || (children[child_index - 1].elements.size() < B)) &&
-        ((child_index + 1 >= children.size()) || (children[child_index + 1].elements.size() < B))) {
+    if ((children[child_index]->elements.size() < B) &&
+        (child_index == 0 || (children[child_index - 1]->elements.size() < B)) &&
+        ((child_index + 1 >= children.size()) || (children[child_index + 1]->elements.size() < B))) {
         // if the child and its immediate siblings have B-1 elements merge the child
         // with one sibling, moving an element from this node into the new merged node
         // to be the median
@@ -358,81 +362,86 @@ Op OpTreeNode::remove_from_internal_child(usize index, usize child_index) {
             Op middle = vector_remove(elements, child_index - 1);
 
             // use the predessor sibling
-            OpTreeNode successor = vector_remove(children, child_index);
+            auto successor = vector_remove(children, child_index);
             --child_index;
 
-            children[child_index].merge(std::move(middle), successor);
+            child_mut(child_index).merge(std::move(middle), make_mut(successor));
         }
         else {
             Op middle = vector_remove(elements, child_index);
 
             // use the sucessor sibling
-            OpTreeNode successor = vector_remove(children, child_index + 1);
+            auto successor = vector_remove(children, child_index + 1);
 
-            children[child_index].merge(std::move(middle), successor);
+            child_mut(child_index).merge(std::move(middle), make_mut(successor));
         }
     }
-    else if (children[child_index].elements.size() < B) {
+    else if (children[child_index]->elements.size() < B) {
         if ((child_index > 0) && (child_index - 1 < children.size()) &&
-            (children[child_index - 1].elements.size() >= B)) {
-            Op last_element = vector_pop(children[child_index - 1].elements);
-            assert(!children[child_index - 1].elements.empty());
-            --children[child_index - 1].length;
-            children[child_index - 1].index.remove(last_element);
+            (children[child_index - 1]->elements.size() >= B)) {
+            auto& predecessor = child_mut(child_index - 1);
+            auto& child = child_mut(child_index);
+
+            Op last_element = vector_pop(predecessor.elements);
+            assert(!predecessor.elements.empty());
+            --predecessor.length;
+            predecessor.index.remove(last_element);
 
             std::swap(elements[child_index - 1], last_element);
             Op& parent_element = last_element;
 
-            children[child_index].index.insert(parent_element);
-            children[child_index].elements.insert(elements.begin(), parent_element);
-            ++children[child_index].length;
+            child.index.insert(parent_element);
+            child.elements.insert(child.elements.begin(), std::move(parent_element));
+            ++child.length;
 
-            if (!children[child_index - 1].children.empty()) {
-                OpTreeNode last_child = vector_pop(children[child_index - 1].children);
+            if (!predecessor.children.empty()) {
+                auto last_child = vector_pop(predecessor.children);
 
-                children[child_index - 1].length -= last_child.len();
-                children[child_index - 1].reindex();
-                children[child_index].length += last_child.len();
-                children[child_index].children.insert(
-                    children[child_index].children.begin(), last_child);
-                children[child_index].reindex();
+                predecessor.length -= last_child->len();
+                predecessor.reindex();
+                child.length += last_child->len();
+                child.children.insert(child.children.begin(), std::move(last_child));
+                child.reindex();
             }
         }
         else if ((child_index + 1 < children.size()) &&
-            (children[child_index + 1].elements.size() >= B)) {
-            Op first_element = vector_remove(children[child_index + 1].elements, 0);
-            children[child_index + 1].index.remove(first_element);
-            --children[child_index + 1].length;
+            (children[child_index + 1]->elements.size() >= B)) {
+            auto& successor = child_mut(child_index + 1);
+            auto& child = child_mut(child_index);
+
+            Op first_element = vector_remove(successor.elements, 0);
+            successor.index.remove(first_element);
+            --successor.length;
 
-            assert(!children[child_index + 1].elements.empty());
+            assert(!successor.elements.empty());
 
             std::swap(elements[child_index], first_element);
             Op& parent_element = first_element;
 
-            ++children[child_index].length;
-            children[child_index].index.insert(parent_element);
-            children[child_index].elements.push_back(std::move(parent_element));
+            ++child.length;
+            child.index.insert(parent_element);
+            child.elements.push_back(std::move(parent_element));
 
-            if (!children[child_index + 1].is_leaf()) {
-                OpTreeNode first_child = vector_remove(children[child_index + 1].children, 0);
-                children[child_index + 1].length -= first_child.len();
-                children[child_index + 1].reindex();
-                children[child_index].length += first_child.len();
+            if (!successor.is_leaf()) {
+                auto first_child = vector_remove(successor.children, 0);
+                successor.length -= first_child->len();
+                successor.reindex();
+                child.length += first_child->len();
 
-                children[child_index].children.push_back(std::move(first_child));
-                children[child_index].reindex();
+                child.children.push_back(std::move(first_child));
+                child.reindex();
             }
         }
     }
     --length;
     usize total_index = cumulative_index(child_index);
-    return children[child_index].remove(index - total_index);
+    return child_mut(child_index).remove(index - total_index);
 }
 
 usize OpTreeNode::check() const {
     usize l = elements.size();
     for (auto& c : children) {
-        l += c.check();
+        l += c->check();
     }
 
     assert(len() == l);
@@ -457,8 +466,7 @@ Op OpTreeNode::remove(usize index) {
 
     usize total_index = 0;
     for (usize child_index = 0; child_index < children.size(); ++child_index) {
-        auto& child = children[child_index];
-        usize tmp_index = total_index + child.len();
+        usize tmp_index = total_index + children[child_index]->len();
         if (tmp_index < index) {
             // should be later on in the loop
             total_index = tmp_index + 1;
@@ -517,13 +525,12 @@ ReplaceArgs OpTreeNode::update(usize index, OpFunc f) {
 
     usize cumulative_len = 0;
     for (usize child_index = 0; child_index < children.size(); ++child_index) {
-        auto& child = children[child_index];
-        usize tmp_len = cumulative_len + child.len();
+        usize tmp_len = cumulative_len + children[child_index]->len();
         if (tmp_len < index) {
             cumulative_len = tmp_len + 1;
         }
         else if (tmp_len > index) {
-            auto replace_args = child.update(index - cumulative_len, f);
+            auto replace_args = child_mut(child_index).update(index - cumulative_len, f);
             this->index.replace(replace_args);
             return replace_args;
         }
@@ -549,7 +556,7 @@ const Op& OpTreeNode::last() const {
     }
 
     // if not a leaf then there is always at least one child
-    return children.back().last();
+    return children.back()->last();
 }
 
 std::optional<const Op*> OpTreeNode::get(usize index) const {
@@ -559,7 +566,7 @@ std::optional<const Op*> OpTreeNode::get(usize index) const {
 
     usize cumulative_len = 0;
     for (usize child_index = 0; child_index < children.size(); ++child_index) {
-        auto& child = children[child_index];
+        auto& child = *children[child_index];
         usize tmp_index = cumulative_len + child.len();
         if (tmp_index < index) {
             cumulative_len = tmp_index + 1;
@@ -578,7 +585,7 @@ std::optional<const Op*> OpTreeNode::get(usize index) const {
 //////////////////////////////////////////////////////
 
 TreeQuery& OpTreeInternal::search(TreeQuery& query, const OpSetMetadata& m) const {
-    if (!root_node.has_value())
+    if (!root_node)
         return query;
 
     auto res = query.query_node_with_metadata(*root_node, m);
@@ -598,10 +605,9 @@ void OpTreeInternal::insert(usize index, Op&& element) {
 #ifndef NDEBUG
     usize old_len = len();
 #endif
-    if (!root_node.has_value()) {
-        OpTreeNode root;
-        root.insert_into_non_full_node(index, std::move(element));
-        root_node = root;
+    if (!root_node) {
+        root_node = std::make_shared<OpTreeNode>();
+        root_node->insert_into_non_full_node(index, std::move(element));
 
         assert(len() == old_len + 1);
         return;
@@ -611,7 +617,7 @@ void OpTreeInternal::insert(usize index, Op&& element) {
     root_node->check();
 #endif
     if (!root_node->is_full()) {
-        root_node->insert_into_non_full_node(index, std::move(element));
+        root_mut().insert_into_non_full_node(index, std::move(element));
 
         assert(len() == old_len + 1);
         return;
@@ -620,13 +626,12 @@ void OpTreeInternal::insert(usize index, Op&& element) {
 #ifndef NDEBUG
     usize original_len = root_node->len();
 #endif
-    OpTreeNode old_root;
-
-    // move a new root to root position
-    std::swap(*root_node, old_root);
+    // move a new root to root position, the old root may still be shared
+    auto old_root = std::move(root_node);
+    root_node = std::make_shared<OpTreeNode>();
 
-    root_node->length += old_root.len();
-    root_node->index = old_root.index;
+    root_node->length += old_root->len();
+    root_node->index = old_root->index;
     root_node->children.push_back(std::move(old_root));
     root_node->split_child(0);
 
@@ -634,14 +639,14 @@ void OpTreeInternal::insert(usize index, Op&& element) {
 
     // after splitting the root has one element and two children, find which child the
     // index is in
-    usize first_child_len = root_node->children[0].len();
+    usize first_child_len = root_node->children[0]->len();
     ++root_node->length;
     root_node->index.insert(element);
     if (first_child_len < index) {
-        root_node->children[1].insert_into_non_full_node(index - (first_child_len + 1), std::move(element));
+        root_node->child_mut(1).insert_into_non_full_node(index - (first_child_len + 1), std::move(element));
     }
     else {
-        root_node->children[0].insert_into_non_full_node(index, std::move(element));
+        root_node->child_mut(0).insert_into_non_full_node(index, std::move(element));
     }
 
     assert(len() == old_len + 1);
@@ -650,23 +655,23 @@ void OpTreeInternal::insert(usize index, Op&& element) {
 
 void OpTreeInternal::update(usize index, OpFunc f) {
     if (len() > index) {
-        if (!root_node.has_value()) {
+        if (!root_node) {
             throw std::runtime_error("update from empty tree");
         }
 
-        root_node->update(index, f);
+        root_mut().update(index, f);
     }
 }
 
 Op OpTreeInternal::remove(usize index) {
-    if (!root_node.has_value()) {
+    if (!root_node) {
         throw std::runtime_error("remove from empty tree");
     }
 
 #ifndef NDEBUG
     usize len = root_node->check();
 #endif
-    Op old = root_node->remove(index);
+    Op old = root_mut().remove(index);
 
     if (root_node->elements.empty()) {
         if (root_node->is_leaf()) {
@@ -5,6 +5,7 @@
 
 #include <string>
 #include <vector>
+#include <memory>
 #include <unordered_map>
 #include <utility>
 #include <tuple>
@@ -52,9 +53,11 @@ struct OpTreeIter {
     std::optional<const Op*> nth(usize n);
 };
 
+// The nodes are persistent: a copied tree shares them with the original, and a write copies only the
+// nodes on the path to the written element which are still shared, see `make_mut`.
 struct OpTreeNode {
 public:
-    std::vector<OpTreeNode> children;
+    std::vector<std::shared_ptr<OpTreeNode>> children;
     std::vector<Op> elements;
     Index index;
     
@@ -80,6 +83,9 @@ public:
     // child.
     std::pair<usize, usize> find_child_index(usize index) const;
 
+    // The child at `child_index`, copied first if another tree shares it.
+    OpTreeNode& child_mut(usize child_index);
+
     void insert_into_non_full_node(usize index, Op&& element);
 
     // A utility function to split the child `full_child_index` of this node
@@ -114,8 +120,18 @@ private:
     friend struct OpTreeInternal;
 };
 
+// The node `node` points to, replaced by a copy first if another tree shares it, so it can be written.
+// `use_count` is only exact while no other thread copies or drops a pointer to the node, so trees
+// that share nodes, a document and its forks, must not be written or destroyed concurrently.
+inline OpTreeNode& make_mut(std::shared_ptr<OpTreeNode>& node) {
+    if (node.use_count() > 1) {
+        node = std::make_shared<OpTreeNode>(*node);
+    }
+    return *node;
+}
+
 struct OpTreeInternal {
-    std::optional<OpTreeNode> root_node;
+    std::shared_ptr<OpTreeNode> root_node;
 
     // Get the length of the sequence.
     usize len() const {
@@ -128,7 +144,7 @@ struct OpTreeInternal {
     }
 
     auto keys() const {
-        return root_node ? std::optional<QueryKeys>{ QueryKeys(&*root_node) } : std::nullopt;
+        return root_node ? std::optional<QueryKeys>{ QueryKeys(root_node.get()) } : std::nullopt;
     }
 
     TreeQuery& search(TreeQuery& query, const OpSetMetadata& m) const;
@@ -152,6 +168,11 @@ struct OpTreeInternal {
     // Removes the element at `index` from the sequence.
     // throw if `index` is out of bounds.
     Op remove(usize index);
+
+private:
+    OpTreeNode& root_mut() {
+        return make_mut(root_node);
+    }
 };
 
 struct OpTree {
@@ -4,17 +4,41 @@
 #include "Query.h"
 #include "OpTree.h"
 
+// The overlays of a shared index are folded once they hold this many entries and an eighth of it.
+constexpr usize INDEX_OVERLAY_MIN = 64;
+
+bool Index::has_visible(const Key& seen) const {
+    if (!visible_overlay.empty()) {
+        auto find = visible_overlay.find(seen);
+        if (find != visible_overlay.end()) {
+            return find->second;
+        }
+    }
+    return data && data->visible.count(seen);
+}
+
+bool Index::has_op(const OpId& id) const {
+    if (!ops_overlay.empty()) {
+        auto find = ops_overlay.find(id);
+        if (find != ops_overlay.end()) {
+            return find->second;
+        }
+    }
+    return data && data->ops.count(id);
+}
+
 void Index::replace(const ReplaceArgs& args) {
     if (!(args.old_id == args.new_id)) {
-        ops.erase(args.old_id);
-        ops.insert(args.new_id);
+        op_set(args.old_id, false);
+        op_set(args.new_id, true);
     }
 
     if (args.old_visible == args.new_visible)
         return;
 
     if (args.new_visible) {
-        ++visible[args.new_key];
+        auto count = visible_get(args.new_key);
+        visible_set(args.new_key, count, count + 1);
     }
     else {
         visible_remove(args.new_key);
@@ -22,14 +46,24 @@ void Index::replace(const ReplaceArgs& args) {
 }
 
 void Index::insert(const Op& op) {
-    ops.insert(op.id);
+    if (own()) {
+        data->ops.insert(op.id);
+        if (op.visible() && (++data->visible[op.elemid_or_key()] == 1)) {
+            ++visible_count;
+        }
+        return;
+    }
+
+    op_set(op.id, true);
     if (op.visible()) {
-        ++visible[op.elemid_or_key()];
+        auto key = op.elemid_or_key();
+        auto count = visible_get(key);
+        visible_set(key, count, count + 1);
     }
 }
 
 void Index::remove(const Op& op) {
-    ops.erase(op.id);
+    op_set(op.id, false);
     if (!op.visible())
         return;
 
@@ -37,24 +71,123 @@ void Index::remove(const Op& op) {
 }
 
 void Index::merge(const Index& other) {
-    for (auto& id : other.ops) {
-        ops.insert(id);
+    if (other.data) {
+        for (auto& id : other.data->ops) {
+            if (!other.ops_overlay.count(id)) {
+                op_set(id, true);
+            }
+        }
+        for (auto& kv : other.data->visible) {
+            if (!other.visible_overlay.count(kv.first)) {
+                auto count = visible_get(kv.first);
+                visible_set(kv.first, count, count + kv.second);
+            }
+        }
+    }
+    for (auto& [id, present] : other.ops_overlay) {
+        if (present) {
+            op_set(id, true);
+        }
     }
-    for (auto& kv : other.visible) {
-        visible[kv.first] += kv.second;
+    for (auto& kv : other.visible_overlay) {
+        if (kv.second) {
+            auto count = visible_get(kv.first);
+            visible_set(kv.first, count, count + kv.second);
+        }
+    }
+}
+
+usize Index::visible_get(const Key& key) const {
+    if (!visible_overlay.empty()) {
+        auto find = visible_overlay.find(key);
+        if (find != visible_overlay.end()) {
+            return find->second;
+        }
+    }
+    if (!data) {
+        return 0;
+    }
+    auto find = data->visible.find(key);
+    return (find == data->visible.end()) ? 0 : find->second;
+}
+
+void Index::visible_set(const Key& key, usize old_count, usize count) {
+    if (!old_count && count) {
+        ++visible_count;
+    }
+    else if (old_count && !count) {
+        --visible_count;
+    }
+
+    if (!own()) {
+        visible_overlay[key] = count;
+    }
+    else if (count) {
+        data->visible[key] = count;
+    }
+    else {
+        data->visible.erase(key);
     }
 }
 
 void Index::visible_remove(const Key& key) {
-    auto find = visible.find(key);
-    if (find == visible.end())
+    auto count = visible_get(key);
+    if (!count)
         throw std::out_of_range("remove overun in index");
-    if (find->second == 1) {
-        visible.erase(find);
+    visible_set(key, count, count - 1);
+}
+
+void Index::op_set(const OpId& id, bool present) {
+    if (!own()) {
+        ops_overlay[id] = present;
+    }
+    else if (present) {
+        data->ops.insert(id);
     }
     else {
-        --find->second;
+        data->ops.erase(id);
+    }
+}
+
+bool Index::own() {
+    if (!data) {
+        data = std::make_shared<Data>();
+        return true;
+    }
+
+    usize overlay_len = visible_overlay.size() + ops_overlay.size();
+    if (data.use_count() > 1) {
+        if ((overlay_len < INDEX_OVERLAY_MIN) || (overlay_len * 8 < data->visible.size() + data->ops.size())) {
+            return false;
+        }
+        data = std::make_shared<Data>(*data);
+    }
+
+    if (overlay_len) {
+        fold();
+    }
+    return true;
+}
+
+void Index::fold() {
+    for (auto& [key, count] : visible_overlay) {
+        if (count) {
+            data->visible[key] = count;
+        }
+        else {
+            data->visible.erase(key);
+        }
+    }
+    for (auto& [id, present] : ops_overlay) {
+        if (present) {
+            data->ops.insert(id);
+        }
+        else {
+            data->ops.erase(id);
+        }
     }
+    visible_overlay.clear();
+    ops_overlay.clear();
 }
 
 ////////////////////////////////////////////////
@@ -5,6 +5,7 @@
 
 #include <string>
 #include <vector>
+#include <memory>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
@@ -62,20 +63,20 @@ public:
     }
 };
 
+// The visible keys and the op ids of a node and the nodes below it.
+// A copied node shares the index of the original. While the index is shared, writes go to small
+// overlays over it rather than copying it, and the overlays are folded into it once it is no longer
+// shared, or into a copy of it once they outgrow an eighth of it.
 struct Index {
 public:
-    // The map of visible keys to the number of visible operations for that key.
-    std::unordered_map<Key, usize> visible;
-    // Set of opids found in this node and below.
-    std::unordered_set<OpId> ops;
-
     usize visible_len() const {
-        return visible.size();
+        return visible_count;
     }
 
-    bool has_visible(const Key& seen) const {
-        return visible.count(seen);
-    }
+    bool has_visible(const Key& seen) const;
+
+    // Whether the op is in this node or below.
+    bool has_op(const OpId& id) const;
 
     void replace(const ReplaceArgs& args);
 
@@ -86,7 +87,34 @@ public:
     void merge(const Index& other);
 
 private:
+    struct Data {
+        // The map of visible keys to the number of visible operations for that key.
+        std::unordered_map<Key, usize> visible;
+        // Set of opids found in this node and below.
+        std::unordered_set<OpId> ops;
+    };
+
+    std::shared_ptr<Data> data;
+    // The counts of the keys written while `data` is shared, 0 for a key no longer visible.
+    std::unordered_map<Key, usize> visible_overlay;
+    // The op ids written while `data` is shared, false for a removed op.
+    std::unordered_map<OpId, bool> ops_overlay;
+    // The number of visible keys, with the overlay applied.
+    usize visible_count = 0;
+
+    usize visible_get(const Key& key) const;
+
+    void visible_set(const Key& key, usize old_count, usize count);
+
     void visible_remove(const Key& key);
+
+    void op_set(const OpId& id, bool present);
+
+    // Whether `data` can be written in place, after folding the overlays into it. If it is shared
+    // and the overlays are still small, the write goes to the overlays instead.
+    bool own();
+
+    void fold();
 };
 
 usize binary_search_by(const OpTreeNode& node, OpCmpFunc f);
@@ -28,7 +28,7 @@ BufferBlcok& BufferBlcok::get_buffer_block(usize len) {
     return *iter;
 }
 
-std::string_view BufferBlcok::cache_string(const std::string& str) {
+std::string_view BufferBlcok::cache_string(const std::string_view& str) {
     auto len = str.size();
     if (len > rest_size()) {
         return {};
@@ -44,14 +44,12 @@ std::string_view BufferBlcok::cache_string(const std::string& str) {
 
 IndexedCache<std::string_view> StringIndexedCache;
 
-StringCache g_cache_string(const std::string& str) {
+StringCache g_cache_string(const std::string_view& str) {
     if (str.size() == 0) {
         return {};
     }
 
-    std::string_view item_view = str;
-
-    auto result = StringIndexedCache._lookup.find(item_view);
+    auto result = StringIndexedCache._lookup.find(str);
     if (result != StringIndexedCache._lookup.end()) {
         return { result->second, result->first };
     }
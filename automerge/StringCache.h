@@ -37,7 +37,7 @@ public:
         return end - begin;
     }
 
-    std::string_view cache_string(const std::string& str);
+    std::string_view cache_string(const std::string_view& str);
 
 private:
     char* data = nullptr;
@@ -48,4 +48,4 @@ private:
 
 using StringCache = std::pair<usize, std::string_view>;
 
-StringCache g_cache_string(const std::string& str);
+StringCache g_cache_string(const std::string_view& str);
@@ -7,7 +7,64 @@
 
 std::vector<u8> SyncMessage::encode() {
     std::vector<u8> buf;
-    buf.push_back(MESSAGE_TYPE_SYNC);
+    encode_into(buf);
+
+    return buf;
+}
+
+void SyncMessage::encode_into(std::vector<u8>& buf) {
+    encode_head(buf, changes.size(), !document.empty());
+
+    Encoder encoder(buf);
+    for (auto& change : changes) {
+        change.compress();
+        encoder.encode(change.bytes.raw());
+    }
+    if (!document.empty() || has_sketch()) {
+        encoder.encode(document);
+    }
+}
+
+void SyncMessage::encode_into(std::vector<u8>& buf, std::vector<BinSlice>& parts) {
+    // `buf` may move as it grows, so its parts are recorded as offsets until it is complete
+    std::vector<std::pair<usize, usize>> buf_parts;
+    usize start = buf.size();
+
+    encode_head(buf, changes.size(), !document.empty());
+    Encoder encoder(buf);
+    for (auto& change : changes) {
+        change.compress();
+        auto raw = change.bytes.raw();
+        encoder.encode(raw.second);
+        buf_parts.emplace_back(start, buf.size() - start);
+        start = buf.size();
+    }
+    if (!document.empty() || has_sketch()) {
+        encoder.encode(document.size());
+    }
+    buf_parts.emplace_back(start, buf.size() - start);
+
+    for (usize i = 0; i < buf_parts.size(); ++i) {
+        if (buf_parts[i].second) {
+            parts.emplace_back(buf.cbegin() + buf_parts[i].first, buf_parts[i].second);
+        }
+        if (i < changes.size()) {
+            parts.push_back(changes[i].bytes.raw());
+        }
+    }
+    if (!document.empty()) {
+        parts.push_back(make_bin_slice(document));
+    }
+}
+
+void SyncMessage::encode_head(std::vector<u8>& buf, usize change_count, bool with_document) const {
+    bool with_sketch = has_sketch();
+    if (with_sketch) {
+        buf.push_back(MESSAGE_TYPE_SYNC_RECONCILE);
+    }
+    else {
+        buf.push_back(with_document ? MESSAGE_TYPE_SYNC_V2 : MESSAGE_TYPE_SYNC);
+    }
 
     Encoder encoder(buf);
 
@@ -18,28 +75,40 @@ std::vector<u8> SyncMessage::encode() {
     for (auto& h : have) {
         encoder.encode(h.last_sync);
         encoder.encode(h.bloom.to_bytes());
+        if (with_sketch) {
+            encoder.encode(h.sketch.to_bytes());
+        }
     }
 
-    encoder.encode((u64)changes.size());
-    for (auto& change : changes) {
-        change.compress();
-        encoder.encode(change.bytes.raw());
-    }
+    encoder.encode((u64)change_count);
+}
 
-    return buf;
+bool SyncMessage::has_sketch() const {
+    return std::any_of(have.cbegin(), have.cend(), [](const Have& h) { return !h.sketch.empty(); });
 }
 
 std::optional<SyncMessage> SyncMessage::decode(const BinSlice& bytes) {
+    auto view = SyncMessageView::decode(bytes);
+    if (!view.has_value()) {
+        return {};
+    }
+
+    return view->to_message();
+}
+
+std::optional<SyncMessageView> SyncMessageView::decode(const BinSlice& bytes) {
     Decoder decoder(bytes);
 
     auto message_type = decoder.read<u8>();
     if (!message_type.has_value()) {
         return {};
     }
-    if (*message_type != MESSAGE_TYPE_SYNC) {
+    if ((*message_type != MESSAGE_TYPE_SYNC) && (*message_type != MESSAGE_TYPE_SYNC_V2) &&
+        (*message_type != MESSAGE_TYPE_SYNC_RECONCILE)) {
         // throw WrongType
         return {};
     }
+    bool with_sketch = (*message_type == MESSAGE_TYPE_SYNC_RECONCILE);
 
     auto heads = decode_hashes(decoder);
     if (!heads.has_value()) {
@@ -64,19 +133,34 @@ std::optional<SyncMessage> SyncMessage::decode(const BinSlice& bytes) {
             return {};
         }
 
-        auto bloom_bytes = decoder.read<std::vector<u8>>();
+        auto bloom_bytes = decoder.read<BinSlice>();
         if (!bloom_bytes.has_value()) {
             return {};
         }
 
-        auto bloom = BloomFilter::parse(BinSlice(bloom_bytes->cbegin(), bloom_bytes->size()));
+        auto bloom = BloomFilter::parse(*bloom_bytes);
         if (!bloom.has_value()) {
             return {};
         }
 
+        Iblt sketch;
+        if (with_sketch) {
+            auto sketch_bytes = decoder.read<BinSlice>();
+            if (!sketch_bytes.has_value()) {
+                return {};
+            }
+
+            auto parsed = Iblt::parse(*sketch_bytes);
+            if (!parsed.has_value()) {
+                return {};
+            }
+            sketch = std::move(*parsed);
+        }
+
         have.push_back(Have{
             std::move(*last_sync),
-            std::move(*bloom)
+            std::move(*bloom),
+            std::move(sketch)
             });
     }
 
@@ -85,30 +169,56 @@ std::optional<SyncMessage> SyncMessage::decode(const BinSlice& bytes) {
         return {};
     }
 
-    std::vector<Change> changes;
+    std::vector<BinSlice> changes;
     changes.reserve(*change_count);
     for (usize i = 0; i < *change_count; ++i) {
-        auto change_bytes = decoder.read<std::vector<u8>>();
+        auto change_bytes = decoder.read<BinSlice>();
         if (!change_bytes.has_value()) {
             return {};
         }
 
-        auto change = Change::from_bytes(std::move(*change_bytes));
-        if (!change.has_value()) {
+        changes.push_back(*change_bytes);
+    }
+
+    BinSlice document = { bytes.first, 0 };
+    if (*message_type != MESSAGE_TYPE_SYNC) {
+        auto document_bytes = decoder.read<BinSlice>();
+        if (!document_bytes.has_value()) {
             return {};
         }
-
-        changes.push_back(std::move(*change));
+        document = *document_bytes;
     }
 
-    return SyncMessage{
+    return SyncMessageView{
         std::move(*heads),
         std::move(*need),
         std::move(have),
-        std::move(changes)
+        std::move(changes),
+        document
     };
 }
 
+Change SyncMessageView::change(usize index, const SharedBytes& shared) const {
+    auto& bytes = changes[index];
+    if (shared) {
+        usize start = bytes.first - shared->cbegin();
+        return Change::decode_change(shared, { start, start + bytes.second });
+    }
+
+    return Change::decode_change(std::vector<u8>(bytes.first, bytes.first + bytes.second));
+}
+
+SyncMessage SyncMessageView::to_message(const SharedBytes& shared) const {
+    std::vector<Change> message_changes;
+    message_changes.reserve(changes.size());
+    for (usize i = 0; i < changes.size(); ++i) {
+        message_changes.push_back(change(i, shared));
+    }
+
+    return SyncMessage{ heads, need, have, std::move(message_changes),
+        std::vector<u8>(document.first, document.first + document.second) };
+}
+
 // TODO: optimise, use pointer in set
 std::vector<ChangeHash> advance_heads(
     std::unordered_set<ChangeHash>&& my_old_heads,
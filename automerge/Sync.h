@@ -13,6 +13,11 @@
 
 // first byte of a sync message, for identification
 constexpr u8 MESSAGE_TYPE_SYNC = 0x42;
+// first byte of a sync message that carries a document chunk, see `State::snapshot_sync`
+constexpr u8 MESSAGE_TYPE_SYNC_V2 = 0x43;
+// first byte of a sync message laid out as `MESSAGE_TYPE_SYNC_V2`, whose haves each carry an `Iblt`
+// after the bloom filter, see `State::reconcile_sync`
+constexpr u8 MESSAGE_TYPE_SYNC_RECONCILE = 0x44;
 
 // The sync message to be sent.
 // #[derive(Clone, Debug, PartialEq)]
@@ -25,12 +30,56 @@ struct SyncMessage {
     std::vector<Have> have;
     // The changes for the recipient to apply
     std::vector<Change> changes;
+    // A snapshot of the sender for the recipient to load, sent instead of the changes to a peer
+    // that lacks most of them. Only a message of type `MESSAGE_TYPE_SYNC_V2` has one.
+    std::vector<u8> document;
 
     std::vector<u8> encode();
 
+    // Append the encoded message to `buf`, so a caller can reuse one buffer for every message.
+    // The changes are compressed in place.
+    void encode_into(std::vector<u8>& buf);
+
+    // Encode the message as a list of slices to be written in order: the changes are compressed
+    // in place and referenced where they are, everything else is appended to `buf`. The slices
+    // are valid until `buf` or the changes are modified.
+    void encode_into(std::vector<u8>& buf, std::vector<BinSlice>& parts);
+
+    // Write the message up to its changes, for `change_count` encoded changes to follow, then a
+    // length prefixed document chunk if `with_document` or `has_sketch`, an empty one if there
+    // is no document.
+    void encode_head(std::vector<u8>& buf, usize change_count, bool with_document) const;
+
+    // Whether a have carries an `Iblt`, so the message is of type `MESSAGE_TYPE_SYNC_RECONCILE`.
+    bool has_sketch() const;
+
     static std::optional<SyncMessage> decode(const BinSlice& bytes);
 };
 
+// A sync message decoded over a borrowed buffer, which must outlive the view. The heads, the need
+// and the have are decoded up front, the changes are slices of the buffer that are only parsed
+// into `Change`s on demand, so a message can be inspected, forwarded or dropped without copying or
+// decoding its changes.
+struct SyncMessageView {
+    std::vector<ChangeHash> heads;
+    std::vector<ChangeHash> need;
+    std::vector<Have> have;
+    // The encoded changes
+    std::vector<BinSlice> changes;
+    // The document chunk, empty if there is none
+    BinSlice document;
+
+    static std::optional<SyncMessageView> decode(const BinSlice& bytes);
+
+    // Parse the change at `index`. If the view was decoded from `shared`, the change references
+    // its bytes there instead of copying them.
+    // throw exception
+    Change change(usize index, const SharedBytes& shared = {}) const;
+
+    // throw exception
+    SyncMessage to_message(const SharedBytes& shared = {}) const;
+};
+
 std::vector<ChangeHash> advance_heads(
     std::unordered_set<ChangeHash>&& my_old_heads,
     std::unordered_set<ChangeHash>&& my_new_heads,
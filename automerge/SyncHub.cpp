@@ -0,0 +1,119 @@
+// Copyright (c) 2022 the VGG Automerge contributors
+// This code is licensed under MIT license (see LICENSE for details)
+
+#include <algorithm>
+
+#include "SyncHub.h"
+
+usize EncodedSyncMessage::size() const {
+    usize len = head.size();
+    for (auto& change : changes) {
+        len += change->size();
+    }
+    if (document) {
+        len += document->size();
+    }
+
+    return len;
+}
+
+std::vector<u8> EncodedSyncMessage::to_bytes() const {
+    std::vector<u8> bytes;
+    bytes.reserve(size());
+
+    bytes.insert(bytes.end(), head.cbegin(), head.cend());
+    for (auto& change : changes) {
+        bytes.insert(bytes.end(), change->cbegin(), change->cend());
+    }
+    if (document) {
+        bytes.insert(bytes.end(), document->cbegin(), document->cend());
+    }
+
+    return bytes;
+}
+
+std::optional<EncodedSyncMessage> SyncHub::generate_sync_message(State& sync_state) {
+    std::vector<const Change*> changes;
+    bool send_snapshot = false;
+    auto message = doc.generate_sync_message(sync_state, [&](std::vector<ChangeHash>&& last_sync) {
+        if (sync_state.reconcile_sync) {
+            return doc.make_sketch(std::move(last_sync), std::max(sync_state.their_wanted_cells(), sync_state.wanted_cells),
+                sync_state.blocked_bloom);
+        }
+        return make_bloom_filter(std::move(last_sync), sync_state.blocked_bloom);
+        }, changes, send_snapshot);
+    if (!message) {
+        return {};
+    }
+
+    EncodedSyncMessage encoded;
+    message->encode_head(encoded.head, changes.size(), send_snapshot);
+    encoded.changes.reserve(changes.size());
+    for (auto change : changes) {
+        encoded.changes.push_back(encode_change(*change));
+    }
+    if (send_snapshot) {
+        encoded.document = encode_snapshot();
+    }
+    else if (message->has_sketch()) {
+        // the message type has a document chunk, an empty one
+        static const auto no_document = std::make_shared<const std::vector<u8>>(1, 0);
+        encoded.document = no_document;
+    }
+
+    return encoded;
+}
+
+Have SyncHub::make_bloom_filter(std::vector<ChangeHash>&& last_sync, bool blocked) {
+    // the history only grows, so its length tells whether the document changed
+    if (blooms_history_len != doc.histroy.size()) {
+        blooms.clear();
+        blooms_history_len = doc.histroy.size();
+    }
+
+    std::sort(last_sync.begin(), last_sync.end());
+    auto key = std::make_pair(blocked, last_sync);
+    auto found = blooms.find(key);
+    if (found == blooms.end()) {
+        found = blooms.emplace(std::move(key), doc.make_bloom_filter(std::move(last_sync), blocked)).first;
+    }
+
+    return found->second;
+}
+
+std::shared_ptr<const std::vector<u8>> SyncHub::encode_change(const Change& change) {
+    auto found = encoded_changes.find(change.hash);
+    if (found != encoded_changes.end()) {
+        return found->second;
+    }
+
+    auto bytes = change.bytes;
+    bytes.compress(change.body_start);
+
+    auto encoded = std::make_shared<std::vector<u8>>();
+    Encoder encoder(*encoded);
+    encoder.encode(bytes.raw());
+
+    if (cached_bytes + encoded->size() > max_cached_bytes) {
+        // messages in use keep their encodings
+        encoded_changes.clear();
+        cached_bytes = 0;
+    }
+    cached_bytes += encoded->size();
+    encoded_changes.emplace(change.hash, encoded);
+
+    return encoded;
+}
+
+std::shared_ptr<const std::vector<u8>> SyncHub::encode_snapshot() {
+    if (!encoded_snapshot || (snapshot_history_len != doc.histroy.size())) {
+        auto encoded = std::make_shared<std::vector<u8>>();
+        Encoder encoder(*encoded);
+        encoder.encode(doc.snapshot());
+
+        encoded_snapshot = std::move(encoded);
+        snapshot_history_len = doc.histroy.size();
+    }
+
+    return encoded_snapshot;
+}
@@ -0,0 +1,80 @@
+// Copyright (c) 2022 the VGG Automerge contributors
+// This code is licensed under MIT license (see LICENSE for details)
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "type.h"
+#include "Automerge.h"
+
+// Once the cached change encodings take more than this many bytes, the cache is dropped.
+constexpr usize SYNC_HUB_MAX_CACHED_BYTES = 64 << 20;
+
+// An encoded sync message whose changes are the encodings cached by a `SyncHub`, shared with every
+// other message that sends them. On the wire the message is `head` followed by each of `changes`,
+// then `document` if there is one.
+struct EncodedSyncMessage {
+    std::vector<u8> head;
+    std::vector<std::shared_ptr<const std::vector<u8>>> changes;
+    std::shared_ptr<const std::vector<u8>> document;
+
+    usize size() const;
+
+    // The message as one buffer, the same bytes as `SyncMessage::encode`.
+    std::vector<u8> to_bytes() const;
+};
+
+// Syncs one document with many peers, each with its own `State`. Building a message for a peer
+// costs a bloom filter of the changes since the heads shared with the peer, and the compression of
+// every change sent. Peers in step share the same heads and receive the same changes, so the hub
+// builds each bloom filter once per set of shared heads, until the document changes, compresses
+// each change once for all the peers it is sent to, and takes one snapshot for all the new peers.
+class SyncHub {
+public:
+    explicit SyncHub(Automerge& doc, usize max_cached_bytes = SYNC_HUB_MAX_CACHED_BYTES) :
+        doc(doc), max_cached_bytes(max_cached_bytes) {}
+
+    SyncHub(const SyncHub&) = delete;
+    SyncHub& operator=(const SyncHub&) = delete;
+
+    Automerge& document() {
+        return doc;
+    }
+
+    // The message `Automerge::generate_sync_message` would send to the peer of `sync_state`.
+    std::optional<EncodedSyncMessage> generate_sync_message(State& sync_state);
+
+    // throw
+    void receive_sync_message(State& sync_state, SyncMessage&& message, OpObserver* options = nullptr) {
+        doc.receive_sync_message_with(sync_state, std::move(message), options);
+    }
+
+private:
+    Automerge& doc;
+    usize max_cached_bytes;
+
+    // The bloom filters by whether they are blocked and the sorted shared heads, built when the
+    // history had `blooms_history_len` changes. A new change may be missing from any of them, so
+    // they are dropped when one arrives.
+    std::map<std::pair<bool, std::vector<ChangeHash>>, Have> blooms;
+    usize blooms_history_len = 0;
+
+    std::unordered_map<ChangeHash, std::shared_ptr<const std::vector<u8>>> encoded_changes;
+    usize cached_bytes = 0;
+
+    // The encoded snapshot, taken when the history had `snapshot_history_len` changes.
+    std::shared_ptr<const std::vector<u8>> encoded_snapshot;
+    usize snapshot_history_len = 0;
+
+    Have make_bloom_filter(std::vector<ChangeHash>&& last_sync, bool blocked);
+
+    std::shared_ptr<const std::vector<u8>> encode_change(const Change& change);
+
+    std::shared_ptr<const std::vector<u8>> encode_snapshot();
+};
@@ -4,6 +4,7 @@
 #pragma once
 
 #include <vector>
+#include <memory>
 #include <iterator>
 #include <algorithm> 
 #include <cassert>
@@ -11,6 +12,34 @@
 
 #include "type.h"
 
+// A value shared by its copies until one of them is written: `mut` copies it first if another copy
+// still shares it. Reads like a const `T`.
+// `use_count` is only exact while no other thread copies or drops the value, so the copies must not
+// be written or destroyed concurrently, see `make_mut` of the op tree.
+template <class T>
+class CopyOnWrite {
+public:
+    CopyOnWrite() : ptr(std::make_shared<T>()) {}
+
+    const T& operator*() const {
+        return *ptr;
+    }
+
+    const T* operator->() const {
+        return ptr.get();
+    }
+
+    T& mut() {
+        if (ptr.use_count() > 1) {
+            ptr = std::make_shared<T>(*ptr);
+        }
+        return *ptr;
+    }
+
+private:
+    std::shared_ptr<T> ptr;
+};
+
 template <class T>
 std::vector<T> vector_split_off(std::vector<T>& source, usize index) {
     assert(source.size() >= index);
@@ -14,3 +14,12 @@ inline unsigned char low_bits_of_u64(unsigned long long val) {
     unsigned long long byte = val & 0xFF;
     return low_bits_of_byte((unsigned char)byte);
 }
+
+// The number of bytes of an unsigned LEB128 encoded value.
+inline unsigned long long unsigned_leb128_len(unsigned long long val) {
+    unsigned long long len = 1;
+    while (val >>= 7) {
+        ++len;
+    }
+    return len;
+}
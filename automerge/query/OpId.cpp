@@ -5,7 +5,7 @@
 #include "../OpTree.h"
 
 QueryResult OpIdSearch::query_node(const OpTreeNode& child) {
-    if (child.index.ops.count(target)) {
+    if (child.index.has_op(target)) {
         return QueryResult{ QueryResult::DESCEND };
     }
     else {
@@ -43,7 +43,7 @@ QueryResult SeekOp::query_node_with_metadata(const OpTreeNode& child, const OpSe
         return QueryResult{ QueryResult::FINISH, 0 };
     }
     else {
-        if (child.index.ops.count(std::get<ElemId>(op.key.data))) {
+        if (child.index.has_op(std::get<ElemId>(op.key.data))) {
             return QueryResult{ QueryResult::DESCEND, 0 };
         }
         else {
@@ -59,7 +59,7 @@ QueryResult SeekOpWithPatch::query_node_with_metadata(const OpTreeNode& child, c
     // Updating a list: search for the tree node that contains the new operation's
     // reference element (i.e. the element we're updating or inserting after)
     else {
-        if (found || child.index.ops.count(std::get<ElemId>(op.key.data))) {
+        if (found || child.index.has_op(std::get<ElemId>(op.key.data))) {
             return QueryResult{ QueryResult::DESCEND, 0 };
         }
         else {
@@ -1,18 +1,40 @@
 // Copyright (c) 2022 the VGG Automerge contributors
 // This code is licensed under MIT license (see LICENSE for details)
 
+#include <algorithm>
 #include <cmath>
+
+#if defined(_MSC_VER)
+#include <xmmintrin.h>
+#endif
+
 #include "Bloom.h"
 #include "../Decoder.h"
 
+// Fetch the cache line at `p` ahead of its use.
+static inline void prefetch(const void* p) {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(p);
+#elif defined(_MSC_VER)
+    _mm_prefetch(static_cast<const char*>(p), _MM_HINT_T0);
+#endif
+}
+
 std::vector<u8> BloomFilter::to_bytes() const {
     std::vector<u8> buf;
     Encoder encoder(buf);
 
     if (num_entries != 0) {
+        if (blocked) {
+            encoder.encode((u32)0);
+            encoder.encode(BLOOM_BLOCKED_TAG);
+            encoder.encode(num_probes);
+        }
         encoder.encode(num_entries);
         encoder.encode(num_bits_per_entry);
-        encoder.encode(num_probes);
+        if (!blocked) {
+            encoder.encode(num_probes);
+        }
         vector_extend(buf, bits);
     }
 
@@ -41,7 +63,20 @@ std::optional<BloomFilter> BloomFilter::parse(const BinSlice& bytes) {
         return {};
     }
 
-    auto bits = decoder.read_bytes(bits_capacity(*num_entries, *num_bits_per_entry));
+    bool blocked = (*num_entries == 0) && (*num_bits_per_entry == BLOOM_BLOCKED_TAG);
+    if (blocked) {
+        num_entries = decoder.read<u32>();
+        if (!num_entries.has_value()) {
+            return {};
+        }
+
+        num_bits_per_entry = decoder.read<u32>();
+        if (!num_bits_per_entry.has_value()) {
+            return {};
+        }
+    }
+
+    auto bits = decoder.read_bytes(bits_capacity(*num_entries, *num_bits_per_entry, blocked));
     if (!bits.has_value()) {
         return {};
     }
@@ -50,51 +85,27 @@ std::optional<BloomFilter> BloomFilter::parse(const BinSlice& bytes) {
         *num_entries,
         *num_bits_per_entry,
         *num_probes,
-        std::vector<u8>(bits->first, bits->first + bits->second)
+        std::vector<u8>(bits->first, bits->first + bits->second),
+        blocked
     );
 }
 
 std::vector<u32> BloomFilter::get_probes(const ChangeHash& hash) const {
-    const u8* hash_bytes = hash.data;
-    u32 modulo = 8 * (u32)bits.size();
-
-    auto bytes_to_u32 = [&](u32 offset) -> u32 {
-        auto start = hash_bytes + offset;
-        u32 res = 0;
-
-        int num = 1;
-        if (*(char*)&num == 1) {
-            // Little-Endian
-            std::copy(start, start + 4, reinterpret_cast<u8*>(&res));
-        }
-        else {
-            // Big-Endian
-            std::copy(std::make_reverse_iterator(start + 4), std::make_reverse_iterator(start), reinterpret_cast<u8*>(&res));
-        }
-
-        return res;
-    };
-
-    u32 x = bytes_to_u32(0) % modulo;
-    u32 y = bytes_to_u32(4) % modulo;
-    u32 z = bytes_to_u32(8) % modulo;
-
     std::vector<u32> probes;
     probes.reserve(num_probes);
-    probes.push_back(x);
-    for (u32 i = 1; i < num_probes; ++i) {
-        x = (x + y) % modulo;
-        y = (y + z) % modulo;
-        probes.push_back(x);
-    }
+    for_each_probe(hash, [&](u32 probe) {
+        probes.push_back(probe);
+        return true;
+        });
 
     return probes;
 }
 
 void BloomFilter::add_hash(const ChangeHash& hash) {
-    for (auto probe : get_probes(hash)) {
+    for_each_probe(hash, [&](u32 probe) {
         set_bit((usize)probe);
-    }
+        return true;
+        });
 }
 
 void BloomFilter::set_bit(usize probe) {
@@ -118,28 +129,66 @@ bool BloomFilter::contains_hash(const ChangeHash& hash) const {
         return false;
     }
 
-    for (auto probe : get_probes(hash)) {
-        auto bit = get_bit((usize)probe);
-        if (bit && (*bit == 0)) {
-            return false;
+    // the probes are all within `bits`
+    const u8* data = bits.data();
+    return for_each_probe(hash, [data](u32 probe) {
+        return (data[probe >> 3] & (1 << (probe & 7))) != 0;
+        });
+}
+
+std::vector<bool> BloomFilter::contains_many(const std::vector<const ChangeHash*>& hashes) const {
+    constexpr usize BATCH = 16;
+
+    std::vector<bool> result(hashes.size(), false);
+    if ((num_entries == 0) || bits.empty()) {
+        return result;
+    }
+
+    // the probes of a batch are worked out and their bits fetched, then tested
+    const u8* data = bits.data();
+    std::vector<u32> probes(BATCH * num_probes);
+    for (usize start = 0; start < hashes.size(); start += BATCH) {
+        usize end = std::min(start + BATCH, hashes.size());
+        u32* out = probes.data();
+        for (usize i = start; i < end; ++i) {
+            for_each_probe(*hashes[i], [&](u32 probe) {
+                prefetch(data + (probe >> 3));
+                *out++ = probe;
+                return true;
+                });
+        }
+
+        const u32* probe = probes.data();
+        for (usize i = start; i < end; ++i, probe += num_probes) {
+            bool contained = true;
+            for (u32 j = 0; j < num_probes; ++j) {
+                contained &= (data[probe[j] >> 3] >> (probe[j] & 7)) & 1;
+            }
+            result[i] = contained;
         }
     }
 
-    return true;
+    return result;
 }
 
-BloomFilter::BloomFilter(std::vector<const ChangeHash*>&& hashes) {
+BloomFilter::BloomFilter(std::vector<const ChangeHash*>&& hashes, bool blocked) : blocked(blocked) {
     num_entries = (u32)hashes.size();
     num_bits_per_entry = BITS_PER_ENTRY;
     num_probes = NUM_PROBES;
-    bits = std::vector<u8>(bits_capacity(num_entries, num_bits_per_entry), 0);
+    bits = std::vector<u8>(bits_capacity(num_entries, num_bits_per_entry, blocked), 0);
 
     for (auto hash : hashes) {
         add_hash(*hash);
     }
 }
 
-usize BloomFilter::bits_capacity(u32 num_entries, u32 num_bits_per_entry) {
+usize BloomFilter::bits_capacity(u32 num_entries, u32 num_bits_per_entry, bool blocked) {
     double f = 1.0 * num_entries * num_bits_per_entry / 8;
-    return (usize)std::ceil(f);
+    usize capacity = (usize)std::ceil(f);
+    if (blocked) {
+        // whole blocks
+        capacity = (capacity + BLOOM_BLOCK_BYTES - 1) / BLOOM_BLOCK_BYTES * BLOOM_BLOCK_BYTES;
+    }
+
+    return capacity;
 }
@@ -16,16 +16,26 @@
 constexpr u32 BITS_PER_ENTRY = 10;
 constexpr u32 NUM_PROBES = 7;
 
+// A blocked filter keeps all the probes of a hash in one block of this many bytes, a cache line,
+// so a lookup touches one cache line instead of one per probe.
+constexpr u32 BLOOM_BLOCK_BYTES = 64;
+// A blocked filter is encoded as a filter of no entries with this in place of the bits per entry,
+// followed by the actual parameters and bits. A peer that does not know blocked filters reads an
+// empty filter, and at worst sends changes we already have.
+constexpr u32 BLOOM_BLOCKED_TAG = 0xb10c;
+
 // #[derive(Debug, Clone, PartialEq, Eq, Hash, serde::Serialize)]
 struct BloomFilter {
     u32 num_entries = 0;
     u32 num_bits_per_entry = BITS_PER_ENTRY;
     u32 num_probes = NUM_PROBES;
     std::vector<u8> bits;
+    bool blocked = false;
 
     BloomFilter() = default;
-    BloomFilter(u32 num_entries, u32 num_bits_per_entry, u32 num_probes, std::vector<u8>&& bits) :
-        num_entries(num_entries), num_bits_per_entry(num_bits_per_entry), num_probes(num_probes), bits(std::move(bits)) {}
+    BloomFilter(u32 num_entries, u32 num_bits_per_entry, u32 num_probes, std::vector<u8>&& bits, bool blocked = false) :
+        num_entries(num_entries), num_bits_per_entry(num_bits_per_entry), num_probes(num_probes), bits(std::move(bits)),
+        blocked(blocked) {}
 
     std::vector<u8> to_bytes() const;
 
@@ -34,6 +44,56 @@ struct BloomFilter {
 
     std::vector<u32> get_probes(const ChangeHash& hash) const;
 
+    // Call `f` with each probe of `hash` in turn, until it returns false. Returns whether every
+    // call returned true.
+    template<class F>
+    bool for_each_probe(const ChangeHash& hash, F&& f) const {
+        u32 modulo = 8 * (u32)bits.size();
+        if (modulo == 0) {
+            return true;
+        }
+
+        u32 x = read_u32(hash, 0);
+        u32 y = read_u32(hash, 4);
+        u32 z = read_u32(hash, 8);
+
+        if (blocked) {
+            // double hashing inside the block picked by `x`, an odd step visits distinct bits
+            u32 block_bits = 8 * BLOOM_BLOCK_BYTES;
+            u32 num_blocks = modulo / block_bits;
+            if (num_blocks == 0) {
+                return true;
+            }
+            u32 base = (x % num_blocks) * block_bits;
+            z |= 1;
+            for (u32 i = 0; i < num_probes; ++i) {
+                if (!f(base + y % block_bits)) {
+                    return false;
+                }
+                y += z;
+            }
+            return true;
+        }
+
+        // `x`, `y` and `z` stay below `modulo`, so a subtraction reduces their sums
+        u64 m = modulo;
+        u64 a = x % modulo;
+        u64 b = y % modulo;
+        u64 c = z % modulo;
+        for (u32 i = 0; i < num_probes; ++i) {
+            if (i) {
+                a += b;
+                a -= (a >= m) ? m : 0;
+                b += c;
+                b -= (b >= m) ? m : 0;
+            }
+            if (!f((u32)a)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
     void add_hash(const ChangeHash& hash);
 
     void set_bit(usize probe);
@@ -42,8 +102,19 @@ struct BloomFilter {
 
     bool contains_hash(const ChangeHash& hash) const;
 
+    // `contains_hash` of each of `hashes`. The hashes are looked up in batches, fetching the bits
+    // of a batch into the cache before testing them, which hides most of the cache misses of a
+    // large filter.
+    std::vector<bool> contains_many(const std::vector<const ChangeHash*>& hashes) const;
+
     // from_hashes
-    BloomFilter(std::vector<const ChangeHash*>&& hashes);
+    BloomFilter(std::vector<const ChangeHash*>&& hashes, bool blocked = false);
+
+    static usize bits_capacity(u32 num_entries, u32 num_bits_per_entry, bool blocked = false);
 
-    static usize bits_capacity(u32 num_entries, u32 num_bits_per_entry);
+private:
+    static u32 read_u32(const ChangeHash& hash, usize offset) {
+        auto bytes = hash.data + offset;
+        return (u32)bytes[0] | ((u32)bytes[1] << 8) | ((u32)bytes[2] << 16) | ((u32)bytes[3] << 24);
+    }
 };
@@ -0,0 +1,192 @@
+// Copyright (c) 2022 the VGG Automerge contributors
+// This code is licensed under MIT license (see LICENSE for details)
+
+#include <cmath>
+#include <limits>
+
+#include "Iblt.h"
+#include "../Encoder.h"
+#include "../Decoder.h"
+
+Iblt::Iblt(const std::vector<const ChangeHash*>& hashes, usize num_cells) {
+    num_cells = (num_cells + IBLT_NUM_PARTS - 1) / IBLT_NUM_PARTS * IBLT_NUM_PARTS;
+    cells.resize(std::max(num_cells, IBLT_NUM_PARTS));
+
+    for (auto hash : hashes) {
+        insert(key(*hash));
+    }
+}
+
+usize Iblt::cells_for(usize difference) {
+    usize num_cells = IBLT_MIN_CELLS + difference + difference / 2;
+
+    return (num_cells + IBLT_NUM_PARTS - 1) / IBLT_NUM_PARTS * IBLT_NUM_PARTS;
+}
+
+u64 Iblt::key(const ChangeHash& hash) {
+    u64 key = 0;
+    for (usize i = 0; i < sizeof(u64); ++i) {
+        key |= (u64)hash.data[i] << (8 * i);
+    }
+
+    return key;
+}
+
+void Iblt::insert(u64 key) {
+    ++num_entries;
+    for (usize part = 0; part < IBLT_NUM_PARTS; ++part) {
+        toggle(cells[cell_index(key, part)], key, 1);
+    }
+}
+
+bool Iblt::difference(const Iblt& other, std::vector<u64>& ours, std::vector<u64>& theirs) const {
+    if (cells.size() != other.cells.size()) {
+        return false;
+    }
+
+    Iblt diff;
+    diff.cells = cells;
+    std::vector<usize> pure_cells;
+    for (usize i = 0; i < cells.size(); ++i) {
+        auto& cell = diff.cells[i];
+        cell.count -= other.cells[i].count;
+        cell.key_sum ^= other.cells[i].key_sum;
+        cell.check_sum ^= other.cells[i].check_sum;
+        if (pure(cell)) {
+            pure_cells.push_back(i);
+        }
+    }
+
+    // a pure cell holds a single key, removing it from its other cells may leave them pure
+    usize peeled = 0;
+    while (!pure_cells.empty()) {
+        auto& cell = diff.cells[pure_cells.back()];
+        pure_cells.pop_back();
+        if (!pure(cell)) {
+            continue;
+        }
+        // a checksum collision could keep peeling garbage forever
+        if (++peeled > cells.size()) {
+            return false;
+        }
+
+        u64 key = cell.key_sum;
+        s64 count = cell.count;
+        (count > 0 ? ours : theirs).push_back(key);
+        for (usize part = 0; part < IBLT_NUM_PARTS; ++part) {
+            usize index = diff.cell_index(key, part);
+            toggle(diff.cells[index], key, -count);
+            if (pure(diff.cells[index])) {
+                pure_cells.push_back(index);
+            }
+        }
+    }
+
+    for (auto& cell : diff.cells) {
+        if ((cell.count != 0) || (cell.key_sum != 0) || (cell.check_sum != 0)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+usize Iblt::estimate_difference(const Iblt& other) const {
+    usize empty = 0;
+    for (usize i = 0; i < std::min(cells.size(), other.cells.size()); ++i) {
+        auto& cell = cells[i];
+        auto& other_cell = other.cells[i];
+        if ((cell.count == other_cell.count) && (cell.key_sum == other_cell.key_sum) &&
+            (cell.check_sum == other_cell.check_sum)) {
+            ++empty;
+        }
+    }
+    if (empty == 0) {
+        return std::numeric_limits<usize>::max();
+    }
+
+    // each key misses a given cell of a part of `n` cells with probability 1 - 1 / n
+    double part_size = (double)cells.size() / IBLT_NUM_PARTS;
+    if (part_size <= 1) {
+        return std::numeric_limits<usize>::max();
+    }
+    double empty_fraction = (double)empty / cells.size();
+
+    return (usize)std::ceil(std::log(empty_fraction) / std::log(1 - 1 / part_size));
+}
+
+std::vector<u8> Iblt::to_bytes() const {
+    std::vector<u8> buf;
+    if (cells.empty()) {
+        return buf;
+    }
+
+    Encoder encoder(buf);
+    encoder.encode(num_entries);
+    encoder.encode(wanted_cells);
+    encoder.encode((u64)cells.size());
+    for (auto& cell : cells) {
+        encoder.encode(cell.count);
+        for (usize i = 0; i < sizeof(u64); ++i) {
+            buf.push_back((u8)(cell.key_sum >> (8 * i)));
+        }
+        for (usize i = 0; i < sizeof(u32); ++i) {
+            buf.push_back((u8)(cell.check_sum >> (8 * i)));
+        }
+    }
+
+    return buf;
+}
+
+std::optional<Iblt> Iblt::parse(const BinSlice& bytes) {
+    if (bytes.second == 0) {
+        return Iblt();
+    }
+
+    Decoder decoder(bytes);
+
+    auto num_entries = decoder.read<u64>();
+    if (!num_entries.has_value()) {
+        return {};
+    }
+
+    auto wanted_cells = decoder.read<u64>();
+    if (!wanted_cells.has_value()) {
+        return {};
+    }
+
+    auto num_cells = decoder.read<u64>();
+    if (!num_cells.has_value()) {
+        return {};
+    }
+    // which bounds the allocation by the input
+    if ((*num_cells == 0) || (*num_cells % IBLT_NUM_PARTS != 0) || (*num_cells > bytes.second / IBLT_CELL_BYTES)) {
+        return {};
+    }
+
+    Iblt iblt;
+    iblt.num_entries = *num_entries;
+    iblt.wanted_cells = *wanted_cells;
+    iblt.cells.resize(*num_cells);
+    for (auto& cell : iblt.cells) {
+        auto count = decoder.read<s64>();
+        if (!count.has_value()) {
+            return {};
+        }
+        cell.count = *count;
+
+        auto sums = decoder.read_bytes(sizeof(u64) + sizeof(u32));
+        if (!sums.has_value()) {
+            return {};
+        }
+        auto p = sums->first;
+        for (usize i = 0; i < sizeof(u64); ++i) {
+            cell.key_sum |= (u64)p[i] << (8 * i);
+        }
+        for (usize i = 0; i < sizeof(u32); ++i) {
+            cell.check_sum |= (u32)p[sizeof(u64) + i] << (8 * i);
+        }
+    }
+
+    return iblt;
+}
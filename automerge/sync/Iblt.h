@@ -0,0 +1,104 @@
+// Copyright (c) 2022 the VGG Automerge contributors
+// This code is licensed under MIT license (see LICENSE for details)
+
+#pragma once
+
+#include <vector>
+#include <optional>
+
+#include "../type.h"
+
+// Each hash goes into one cell of each of this many equal parts of the table.
+constexpr usize IBLT_NUM_PARTS = 3;
+// The smallest table, which decodes a difference of up to about a dozen changes. A table for a
+// larger difference takes 3 cells per 2 changes on top.
+constexpr usize IBLT_MIN_CELLS = 24;
+// The encoded size of a cell whose count takes one byte, the smallest.
+constexpr usize IBLT_CELL_BYTES = 13;
+
+// #[derive(Debug, Clone, PartialEq, Eq)]
+struct IbltCell {
+    s64 count = 0;
+    // the xor of the keys in the cell
+    u64 key_sum = 0;
+    // the xor of the checksums of the keys in the cell
+    u32 check_sum = 0;
+};
+
+// An invertible Bloom lookup table of change hashes, a summary of a set of changes that costs
+// bytes in proportion to the difference it is meant to find rather than to the size of the set.
+// A peer subtracts its own table of the same size from ours and peels the result, finding exactly
+// the changes only one of us has, as long as there are not many more of them than the table was
+// sized for. A hash is keyed by its first 8 bytes.
+// Keys are not checked against the full hashes, which the table does not carry. Two of our
+// changes sharing a key, or a key peeled that is none of our changes, makes the difference fail
+// to decode, see `Automerge::get_changes_to_send`. A change only we have that shares its key with
+// one only the peer has cancels out unseen, with odds of about 2^-64 per such pair; the heads
+// exchanged afterwards name it, and the peer then asks for it by its full hash in `need`.
+// #[derive(Debug, Clone, Default, PartialEq, Eq)]
+struct Iblt {
+    // The number of hashes in the table.
+    u64 num_entries = 0;
+    // The number of cells the sender of the table asks for in the tables it is sent, because the
+    // last one did not decode, or 0.
+    u64 wanted_cells = 0;
+    std::vector<IbltCell> cells;
+
+    Iblt() = default;
+
+    // A table of at least `num_cells` cells, rounded up to whole parts.
+    Iblt(const std::vector<const ChangeHash*>& hashes, usize num_cells);
+
+    bool empty() const {
+        return cells.empty();
+    }
+
+    // The number of cells of a table to find a difference of `difference` changes.
+    static usize cells_for(usize difference);
+
+    static u64 key(const ChangeHash& hash);
+
+    void insert(u64 key);
+
+    // Subtract `other`, a table of the same size, and peel the difference: `ours` gets the keys
+    // only in this table, `theirs` those only in `other`. Returns false if the difference is too
+    // large to decode.
+    bool difference(const Iblt& other, std::vector<u64>& ours, std::vector<u64>& theirs) const;
+
+    // Estimate the size of the difference from `other`, a table of the same size, by the cells it
+    // leaves empty. For a difference too large to decode.
+    usize estimate_difference(const Iblt& other) const;
+
+    std::vector<u8> to_bytes() const;
+
+    static std::optional<Iblt> parse(const BinSlice& bytes);
+
+private:
+    static u64 mix(u64 x) {
+        // splitmix64
+        x += 0x9e3779b97f4a7c15;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+        return x ^ (x >> 31);
+    }
+
+    static u32 check(u64 key) {
+        return (u32)mix(key ^ 0xc3a5c85c97cb3127);
+    }
+
+    // The cell of `key` in part `part`.
+    usize cell_index(u64 key, usize part) const {
+        usize part_size = cells.size() / IBLT_NUM_PARTS;
+        return part * part_size + (usize)(mix(key + part) % part_size);
+    }
+
+    static void toggle(IbltCell& cell, u64 key, s64 count) {
+        cell.count += count;
+        cell.key_sum ^= key;
+        cell.check_sum ^= check(key);
+    }
+
+    static bool pure(const IbltCell& cell) {
+        return ((cell.count == 1) || (cell.count == -1)) && (cell.check_sum == check(cell.key_sum));
+    }
+};
@@ -1,10 +1,88 @@
 // Copyright (c) 2022 the VGG Automerge contributors
 // This code is licensed under MIT license (see LICENSE for details)
 
+#include <algorithm>
+
 #include "State.h"
 #include "../Encoder.h"
 #include "../Decoder.h"
 
+usize ChangeRanges::size() const {
+    usize len = 0;
+    for (auto& [begin, end] : ranges) {
+        len += end - begin;
+    }
+
+    return len;
+}
+
+bool ChangeRanges::contains(usize position) const {
+    // the first range that ends past `position`
+    auto iter = std::upper_bound(ranges.cbegin(), ranges.cend(), position,
+        [](usize pos, const std::pair<usize, usize>& range) { return pos < range.second; });
+
+    return (iter != ranges.cend()) && (iter->first <= position);
+}
+
+void ChangeRanges::insert(usize position) {
+    // changes are mostly sent in history order, so most inserts extend the last range
+    if (!ranges.empty() && (ranges.back().second == position)) {
+        ++ranges.back().second;
+        return;
+    }
+
+    auto iter = std::upper_bound(ranges.begin(), ranges.end(), position,
+        [](usize pos, const std::pair<usize, usize>& range) { return pos < range.second; });
+    if ((iter != ranges.end()) && (iter->first <= position)) {
+        return;
+    }
+
+    bool joins_prev = (iter != ranges.begin()) && (std::prev(iter)->second == position);
+    bool joins_next = (iter != ranges.end()) && (iter->first == position + 1);
+    if (joins_prev && joins_next) {
+        std::prev(iter)->second = iter->second;
+        ranges.erase(iter);
+    }
+    else if (joins_prev) {
+        std::prev(iter)->second = position + 1;
+    }
+    else if (joins_next) {
+        iter->first = position;
+    }
+    else {
+        ranges.insert(iter, { position, position + 1 });
+    }
+}
+
+void ChangeRanges::remove_if(const std::function<bool(usize)>& pred) {
+    std::vector<std::pair<usize, usize>> kept;
+    for (auto& [begin, end] : ranges) {
+        for (usize position = begin; position < end; ++position) {
+            if (pred(position)) {
+                continue;
+            }
+            if (!kept.empty() && (kept.back().second == position)) {
+                ++kept.back().second;
+            }
+            else {
+                kept.emplace_back(position, position + 1);
+            }
+        }
+    }
+    ranges = std::move(kept);
+}
+
+usize State::their_wanted_cells() const {
+    usize wanted = 0;
+    if (their_have) {
+        for (auto& have : *their_have) {
+            wanted = std::max(wanted, (usize)have.sketch.wanted_cells);
+        }
+    }
+
+    return wanted;
+}
+
 std::vector<u8> State::encode() const {
     std::vector<u8> buf;
     buf.push_back(SYNC_STATE_TYPE);
@@ -15,6 +93,37 @@ std::vector<u8> State::encode() const {
     return buf;
 }
 
+std::vector<u8> State::encode_session() const {
+    auto buf = encode();
+    Encoder encoder(buf);
+
+    // each part is a flag for whether it is there, then the part
+    encoder.encode((u64)their_heads.has_value());
+    if (their_heads) {
+        encoder.encode(*their_heads);
+    }
+
+    encoder.encode((u64)their_need.has_value());
+    if (their_need) {
+        encoder.encode(*their_need);
+    }
+
+    encoder.encode((u64)their_have.has_value());
+    if (their_have) {
+        encoder.encode((u64)their_have->size());
+        for (auto& have : *their_have) {
+            encoder.encode(have.last_sync);
+            encoder.encode(have.bloom.to_bytes());
+        }
+        // appended after the filters, which is where a decoder that does not know them stops
+        for (auto& have : *their_have) {
+            encoder.encode(have.sketch.to_bytes());
+        }
+    }
+
+    return buf;
+}
+
 std::optional<State> State::decode(const BinSlice& bytes) {
     Decoder decoder(bytes);
 
@@ -32,7 +141,7 @@ std::optional<State> State::decode(const BinSlice& bytes) {
         return {};
     }
 
-    return State{
+    State state{
         std::move(*shared_heads),
         {},
         {},
@@ -41,6 +150,82 @@ std::optional<State> State::decode(const BinSlice& bytes) {
         {},
         false
     };
+    if (decoder.done()) {
+        return state;
+    }
+
+    // the session, see `encode_session`
+    auto has_their_heads = decoder.read<u64>();
+    if (!has_their_heads.has_value()) {
+        return {};
+    }
+    if (*has_their_heads) {
+        state.their_heads = decode_hashes(decoder);
+        if (!state.their_heads.has_value()) {
+            return {};
+        }
+    }
+
+    auto has_their_need = decoder.read<u64>();
+    if (!has_their_need.has_value()) {
+        return {};
+    }
+    if (*has_their_need) {
+        state.their_need = decode_hashes(decoder);
+        if (!state.their_need.has_value()) {
+            return {};
+        }
+    }
+
+    auto has_their_have = decoder.read<u64>();
+    if (!has_their_have.has_value()) {
+        return {};
+    }
+    if (!*has_their_have) {
+        state.their_have.reset();
+        return state;
+    }
+
+    auto have_count = decoder.read<u64>();
+    if (!have_count.has_value()) {
+        return {};
+    }
+    for (usize i = 0; i < *have_count; ++i) {
+        auto last_sync = decode_hashes(decoder);
+        if (!last_sync.has_value()) {
+            return {};
+        }
+
+        auto bloom_bytes = decoder.read<BinSlice>();
+        if (!bloom_bytes.has_value()) {
+            return {};
+        }
+
+        auto bloom = BloomFilter::parse(*bloom_bytes);
+        if (!bloom.has_value()) {
+            return {};
+        }
+
+        state.their_have->push_back(Have{ std::move(*last_sync), std::move(*bloom) });
+    }
+    if (decoder.done()) {
+        return state;
+    }
+
+    for (auto& have : *state.their_have) {
+        auto sketch_bytes = decoder.read<BinSlice>();
+        if (!sketch_bytes.has_value()) {
+            return {};
+        }
+
+        auto sketch = Iblt::parse(*sketch_bytes);
+        if (!sketch.has_value()) {
+            return {};
+        }
+        have.sketch = std::move(*sketch);
+    }
+
+    return state;
 }
 
 std::optional<std::vector<ChangeHash>> decode_hashes(Decoder& decoder) {
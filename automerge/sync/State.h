@@ -4,16 +4,54 @@
 #pragma once
 
 #include <vector>
-#include <set>
+#include <functional>
 #include <optional>
+#include <utility>
 
 #include "../type.h"
 #include "../Decoder.h"
 #include "Bloom.h"
+#include "Iblt.h"
 
 // first byte of an encoded sync state, for identification
 constexpr u8 SYNC_STATE_TYPE = 0x43;
 
+// The fewest changes a history has before a peer lacking half of it is sent a snapshot, see
+// `State::snapshot_sync`. The document chunk of a smaller history saves little over its changes.
+constexpr usize SNAPSHOT_MIN_CHANGES = 64;
+
+// A set of changes by their positions in the history of a document, as sorted disjoint ranges.
+// The changes sent to a peer are mostly runs of consecutive changes, so the set takes a few ranges
+// where a set of hashes takes a tree node per change.
+class ChangeRanges {
+public:
+    bool empty() const {
+        return ranges.empty();
+    }
+
+    // The number of changes in the set.
+    usize size() const;
+
+    bool contains(usize position) const;
+
+    void insert(usize position);
+
+    void clear() {
+        ranges.clear();
+    }
+
+    // Remove the changes `pred` holds for.
+    void remove_if(const std::function<bool(usize)>& pred);
+
+    // The ranges, as [begin, end) pairs.
+    const std::vector<std::pair<usize, usize>>& get_ranges() const {
+        return ranges;
+    }
+
+private:
+    std::vector<std::pair<usize, usize>> ranges;
+};
+
 // A summary of the changes that the sender of the message already has.
 // This is implicitly a request to the recipient to send all changes that the
 // sender does not already have.
@@ -24,6 +62,9 @@ struct Have {
     // A bloom filter summarising all of the changes that the sender of the message has added
     // since the last sync.
     BloomFilter bloom;
+    // The same changes as an invertible Bloom lookup table, sent instead of the bloom filter to a
+    // peer that reconciles, see `State::reconcile_sync`.
+    Iblt sketch;
 };
 
 // The state of synchronisation with a peer.
@@ -43,8 +84,8 @@ struct State{
     std::optional<std::vector<ChangeHash>> their_need;
     // The bloom filters summarising what they said they have
     std::optional<std::vector<Have>> their_have;
-    // The hashes we have sent in this session
-    std::set<ChangeHash> sent_hashes;
+    // The changes we have sent in this session, by their positions in our history
+    ChangeRanges sent_changes;
 
     // `generate_sync_message` should return `None` if there are no new changes to send. In
     // particular, if there are changes in flight which the other end has not yet acknowledged we
@@ -55,7 +96,53 @@ struct State{
     // in `receive_sync_message`.
     bool in_flight = false;
 
+    // The peer lacks changes that this document has compacted, so `generate_sync_message` cannot
+    // send them. Send the peer a `snapshot` of the document instead, which it applies with
+    // `load_incremental`, and carry on syncing afterwards.
+    bool needs_snapshot = false;
+
+    // The peer understands messages of type `MESSAGE_TYPE_SYNC_V2`. A peer lacking at least half
+    // of a history of `SNAPSHOT_MIN_CHANGES` or more, a new peer in particular, or lacking changes
+    // that are compacted, is then sent a snapshot of the document in one message instead of the
+    // changes, whatever the limits below.
+    bool snapshot_sync = false;
+
+    // The peer understands blocked bloom filters, so the filters sent to it are built blocked,
+    // see `BLOOM_BLOCKED_TAG`.
+    bool blocked_bloom = false;
+
+    // Limits on the changes of one message, 0 for no limit: the number of changes, and their total
+    // size before compression. A message carries at least one change, however large. The changes
+    // that do not fit are sent in causal order by the following messages, which do not wait for
+    // the peer to acknowledge the earlier ones, so a large initial sync is streamed in pieces.
+    usize max_message_changes = 0;
+    usize max_message_bytes = 0;
+
+    // The changes cut from the last message by the limits, still to be sent. The next is at the
+    // back.
+    std::vector<ChangeHash> unsent;
+
+    // The peer understands messages of type `MESSAGE_TYPE_SYNC_RECONCILE`, so our changes since the
+    // last sync are summarised for it by an `Iblt` instead of a bloom filter. The peer then finds
+    // exactly the changes we lack, without the false positives of a bloom filter, from a summary
+    // sized by the changes that differ rather than by all the changes since the last sync.
+    bool reconcile_sync = false;
+
+    // The cells we ask the peer for in its next `Iblt`, because its last one was too small to
+    // decode, or 0. Our own next `Iblt` is as large.
+    usize wanted_cells = 0;
+
+    // The cells the peer asked for in our next `Iblt`, or 0.
+    usize their_wanted_cells() const;
+
     std::vector<u8> encode() const;
+
+    // `encode` followed by what the peer last told us: its heads, its needs and its bloom
+    // filters. Restored by `decode`, they let the first `generate_sync_message` after a reconnect
+    // send the changes the peer lacks, instead of first exchanging bloom filters again. A decoder
+    // that only knows `encode` ignores them.
+    std::vector<u8> encode_session() const;
+
     static std::optional<State> decode(const BinSlice& bytes);
 };
 
@@ -0,0 +1,141 @@
+// Copyright (c) 2022 the VGG Automerge contributors
+// This code is licensed under MIT license (see LICENSE for details)
+
+#include <chrono>
+#include <stdexcept>
+
+#include "SyncNetwork.h"
+
+using Timer = std::chrono::steady_clock;
+
+static double seconds_since(Timer::time_point start) {
+    return std::chrono::duration<double>(Timer::now() - start).count();
+}
+
+SyncNetwork::SyncNetwork(std::vector<Automerge>&& docs, const SyncNetworkOptions& options) :
+    docs(std::move(docs)), options(options), random(options.seed), chance(0.0, 1.0) {
+    usize n = this->docs.size();
+    switch (options.topology) {
+    case SyncTopology::Star:
+        for (usize i = 1; i < n; ++i) {
+            add_link(0, i);
+        }
+        break;
+    case SyncTopology::Mesh:
+        for (usize i = 0; i < n; ++i) {
+            for (usize j = i + 1; j < n; ++j) {
+                add_link(i, j);
+            }
+        }
+        break;
+    case SyncTopology::Chain:
+        for (usize i = 1; i < n; ++i) {
+            add_link(i - 1, i);
+        }
+        break;
+    }
+}
+
+void SyncNetwork::add_link(usize a, usize b) {
+    usize i = links.size();
+    links.push_back({ a, b, State() });
+    links.push_back({ b, a, State() });
+    peer_link.push_back(i + 1);
+    peer_link.push_back(i);
+}
+
+bool SyncNetwork::converged() const {
+    auto heads = docs.front().get_heads();
+    for (auto& doc : docs) {
+        if (doc.get_heads() != heads) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+SyncNetworkStats SyncNetwork::run() {
+    stats = {};
+    for (usize round = 0; round < options.max_rounds; ++round) {
+        usize sent = send(round);
+        usize delivered = deliver(round);
+        ++stats.rounds;
+
+        if (!in_flight.empty()) {
+            continue;
+        }
+        if (converged()) {
+            stats.converged = true;
+            break;
+        }
+        if ((sent == 0) && (delivered == 0)) {
+            // lost messages left the links waiting for each other
+            reconnect();
+        }
+    }
+
+    return stats;
+}
+
+usize SyncNetwork::send(usize round) {
+    usize sent = 0;
+    for (usize i = 0; i < links.size(); ++i) {
+        auto& link = links[i];
+
+        auto start = Timer::now();
+        auto message = docs[link.from].generate_sync_message(link.state);
+        if (!message) {
+            stats.generate_seconds += seconds_since(start);
+            continue;
+        }
+        auto bytes = message->encode();
+        stats.generate_seconds += seconds_since(start);
+
+        ++sent;
+        ++stats.messages;
+        stats.bytes += bytes.size();
+
+        if (chance(random) < options.drop) {
+            continue;
+        }
+        usize copies = (chance(random) < options.duplicate) ? 2 : 1;
+        for (usize copy = 0; copy < copies; ++copy) {
+            usize delay = options.latency + (options.jitter ? random() % (options.jitter + 1) : 0);
+            in_flight.push_back({ round + delay, peer_link[i], bytes });
+        }
+    }
+
+    return sent;
+}
+
+usize SyncNetwork::deliver(usize round) {
+    usize delivered = 0;
+    std::vector<InFlight> later;
+    for (auto& message : in_flight) {
+        if (message.arrival > round) {
+            later.push_back(std::move(message));
+            continue;
+        }
+
+        auto& link = links[message.link];
+        auto start = Timer::now();
+        auto decoded = SyncMessage::decode(make_bin_slice(message.bytes));
+        if (!decoded) {
+            throw std::runtime_error("failed to decode sync message");
+        }
+        docs[link.from].receive_sync_message(link.state, std::move(*decoded));
+        stats.receive_seconds += seconds_since(start);
+        ++delivered;
+    }
+    in_flight = std::move(later);
+
+    return delivered;
+}
+
+void SyncNetwork::reconnect() {
+    ++stats.reconnects;
+    for (auto& link : links) {
+        link.state = *State::decode(make_bin_slice(link.state.encode()));
+    }
+}
@@ -0,0 +1,100 @@
+// Copyright (c) 2022 the VGG Automerge contributors
+// This code is licensed under MIT license (see LICENSE for details)
+
+#pragma once
+
+#include <random>
+#include <vector>
+
+#include "Automerge.h"
+
+enum class SyncTopology {
+    // every peer syncs with the first one
+    Star,
+    // every peer syncs with every other
+    Mesh,
+    // every peer syncs with the one before and the one after it
+    Chain,
+};
+
+struct SyncNetworkOptions {
+    SyncTopology topology = SyncTopology::Mesh;
+    // Rounds a message takes to arrive, plus a random 0 to `jitter` more. A jitter reorders the
+    // messages of a link.
+    usize latency = 1;
+    usize jitter = 0;
+    // The probabilities that a message is lost, and that it arrives twice.
+    double drop = 0;
+    double duplicate = 0;
+    u64 seed = 1;
+    // `run` gives up after this many rounds.
+    usize max_rounds = 10000;
+};
+
+struct SyncNetworkStats {
+    bool converged = false;
+    usize rounds = 0;
+    usize messages = 0;
+    usize bytes = 0;
+    // Times every link was reset, as after a reconnect, when lost messages stalled the sync.
+    usize reconnects = 0;
+    // CPU time in `generate_sync_message` and `receive_sync_message`
+    double generate_seconds = 0;
+    double receive_seconds = 0;
+};
+
+// An in-process network of documents syncing over simulated links. Each round, every peer
+// generates a message for each of its neighbours, and the messages due that round are delivered.
+// Messages travel encoded, so the bytes counted are the bytes on the wire.
+class SyncNetwork {
+public:
+    SyncNetwork(std::vector<Automerge>&& docs, const SyncNetworkOptions& options);
+
+    Automerge& doc(usize peer) {
+        return docs[peer];
+    }
+
+    usize size() const {
+        return docs.size();
+    }
+
+    // Sync until every peer has the same heads and no message is in flight. A run after further
+    // edits continues the sessions of the last one, and counts only the sync of those edits.
+    // throw exception
+    SyncNetworkStats run();
+
+private:
+    struct Link {
+        usize from;
+        usize to;
+        State state;
+    };
+
+    struct InFlight {
+        usize arrival;
+        usize link;
+        std::vector<u8> bytes;
+    };
+
+    std::vector<Automerge> docs;
+    SyncNetworkOptions options;
+    std::vector<Link> links;
+    // `links[peer_link[i]]` is the reverse of `links[i]`
+    std::vector<usize> peer_link;
+    std::vector<InFlight> in_flight;
+    std::mt19937_64 random;
+    std::uniform_real_distribution<double> chance;
+    SyncNetworkStats stats;
+
+    void add_link(usize a, usize b);
+
+    bool converged() const;
+
+    // Send the messages of every link, returns the number sent.
+    usize send(usize round);
+
+    // Deliver the messages due by `round`, returns the number delivered.
+    usize deliver(usize round);
+
+    void reconnect();
+};
@@ -0,0 +1,84 @@
+// Copyright (c) 2022 the VGG Automerge contributors
+// This code is licensed under MIT license (see LICENSE for details)
+
+#include <cstring>
+
+#include <benchmark/benchmark.h>
+
+#include "sync/Bloom.h"
+
+// `n` random hashes, splitmix64
+static std::vector<ChangeHash> random_hashes(usize n, u64 seed) {
+    std::vector<ChangeHash> hashes(n);
+    for (auto& hash : hashes) {
+        for (usize j = 0; j < HASH_SIZE; j += 8) {
+            u64 z = (seed += 0x9e3779b97f4a7c15);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+            z ^= z >> 31;
+            std::memcpy(hash.data + j, &z, 8);
+        }
+    }
+
+    return hashes;
+}
+
+static std::vector<const ChangeHash*> pointers(const std::vector<ChangeHash>& hashes) {
+    std::vector<const ChangeHash*> result;
+    result.reserve(hashes.size());
+    for (auto& hash : hashes) {
+        result.push_back(&hash);
+    }
+
+    return result;
+}
+
+// A filter of 1M hashes, queried with 1M hashes of which half were added. The range is whether
+// the filter is blocked.
+struct BloomFixture {
+    std::vector<ChangeHash> added = random_hashes(1000000, 1);
+    std::vector<ChangeHash> queried;
+
+    BloomFixture() {
+        queried = random_hashes(500000, 2);
+        queried.insert(queried.end(), added.cbegin(), added.cbegin() + 500000);
+    }
+};
+
+static const BloomFixture& bloom_fixture() {
+    static BloomFixture fixture;
+    return fixture;
+}
+
+static void bloom_build(benchmark::State& state) {
+    auto& fixture = bloom_fixture();
+    for (auto _ : state) {
+        auto bloom = BloomFilter(pointers(fixture.added), state.range(0));
+        benchmark::DoNotOptimize(bloom);
+    }
+}
+BENCHMARK(bloom_build)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+static void bloom_contains_hash(benchmark::State& state) {
+    auto& fixture = bloom_fixture();
+    auto bloom = BloomFilter(pointers(fixture.added), state.range(0));
+    for (auto _ : state) {
+        usize found = 0;
+        for (auto& hash : fixture.queried) {
+            found += bloom.contains_hash(hash);
+        }
+        benchmark::DoNotOptimize(found);
+    }
+}
+BENCHMARK(bloom_contains_hash)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+static void bloom_contains_many(benchmark::State& state) {
+    auto& fixture = bloom_fixture();
+    auto bloom = BloomFilter(pointers(fixture.added), state.range(0));
+    auto queried = pointers(fixture.queried);
+    for (auto _ : state) {
+        auto found = bloom.contains_many(queried);
+        benchmark::DoNotOptimize(found);
+    }
+}
+BENCHMARK(bloom_contains_many)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
@@ -0,0 +1,201 @@
+// Copyright (c) 2022 the VGG Automerge contributors
+// This code is licensed under MIT license (see LICENSE for details)
+
+#include <benchmark/benchmark.h>
+
+#include "Automerge.h"
+
+// A vector clock that stores only the actors it has entries for, sorted by actor index, to weigh
+// the dense `Clock` against where a clock covers few of many actors.
+struct SparseClock {
+    std::vector<std::pair<usize, ClockData>> clock;
+
+    // See `Clock::cmp`, the entries of both clocks are merged in actor order.
+    std::optional<int> cmp(const SparseClock& other) const {
+        bool has_greater = false;
+        bool has_less = false;
+
+        auto iter = clock.cbegin();
+        auto other_iter = other.clock.cbegin();
+        while ((iter != clock.cend()) || (other_iter != other.clock.cend())) {
+            if ((other_iter == other.clock.cend()) || ((iter != clock.cend()) && (iter->first < other_iter->first))) {
+                has_greater = true;
+                ++iter;
+            }
+            else if ((iter == clock.cend()) || (other_iter->first < iter->first)) {
+                has_less = true;
+                ++other_iter;
+            }
+            else {
+                has_greater |= (other_iter->second < iter->second);
+                has_less |= (iter->second < other_iter->second);
+                ++iter;
+                ++other_iter;
+            }
+
+            if (has_greater && has_less) {
+                // concurrent
+                return std::nullopt;
+            }
+        }
+
+        if (has_greater) {
+            return { 1 };
+        }
+        if (has_less) {
+            return { -1 };
+        }
+        return { 0 };
+    }
+
+    bool is_greater(const SparseClock& other) const {
+        auto res = cmp(other);
+        return res && (*res > 0);
+    }
+
+    void include(usize actor_index, ClockData data) {
+        auto iter = lower_bound(actor_index);
+        if ((iter == clock.end()) || (iter->first != actor_index)) {
+            clock.insert(iter, { actor_index, data });
+        }
+        else if (iter->second.is_older(data)) {
+            iter->second = data;
+        }
+    }
+
+    bool covers(const OpId& id) const {
+        auto data = get_for_actor(id.actor);
+        return data && (data->max_op >= id.counter);
+    }
+
+    std::optional<ClockData> get_for_actor(usize actor_index) const {
+        auto iter = std::lower_bound(clock.cbegin(), clock.cend(), actor_index, [](const std::pair<usize, ClockData>& entry, usize index) {
+            return entry.first < index;
+            });
+        if ((iter != clock.cend()) && (iter->first == actor_index)) {
+            return iter->second;
+        }
+        return {};
+    }
+
+    bool operator==(const SparseClock& other) const {
+        auto res = cmp(other);
+        return res && (*res == 0);
+    }
+
+private:
+    std::vector<std::pair<usize, ClockData>>::iterator lower_bound(usize actor_index) {
+        return std::lower_bound(clock.begin(), clock.end(), actor_index, [](const std::pair<usize, ClockData>& entry, usize index) {
+            return entry.first < index;
+            });
+    }
+};
+
+
+template<class T>
+static T full_clock(usize actors, u64 max_op) {
+    T clock;
+    for (usize i = 0; i < actors; ++i) {
+        clock.include(i, ClockData{ max_op + i, 1 });
+    }
+
+    return clock;
+}
+
+// A document with one change from each of `actors` actors, each change depending on the last one.
+static Automerge many_actors(usize actors) {
+    Automerge doc;
+    for (usize i = 0; i < actors; ++i) {
+        doc.set_actor(ActorId(true));
+        doc.put(ExId(), Prop("key"), ScalarValue{ ScalarValue::Uint, (u64)i });
+        doc.commit();
+    }
+
+    return doc;
+}
+
+template<class T>
+static void clock_include(benchmark::State& state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(full_clock<T>(state.range(0), 1));
+    }
+}
+BENCHMARK_TEMPLATE(clock_include, Clock)->Arg(1000);
+BENCHMARK_TEMPLATE(clock_include, SparseClock)->Arg(1000);
+
+template<class T>
+static void clock_cmp(benchmark::State& state) {
+    auto a = full_clock<T>(state.range(0), 1);
+    auto b = full_clock<T>(state.range(0), 1);
+    b.include(state.range(0) - 1, ClockData{ (u64)state.range(0) + 1, 2 });
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(a.cmp(b));
+    }
+}
+BENCHMARK_TEMPLATE(clock_cmp, Clock)->Arg(1000);
+BENCHMARK_TEMPLATE(clock_cmp, SparseClock)->Arg(1000);
+
+template<class T>
+static void clock_covers(benchmark::State& state) {
+    // half of the lookups miss
+    auto clock = full_clock<T>(state.range(0) / 2, 1);
+    for (auto _ : state) {
+        for (usize i = 0; i < (usize)state.range(0); ++i) {
+            benchmark::DoNotOptimize(clock.covers(OpId{ 1, i }));
+        }
+    }
+}
+BENCHMARK_TEMPLATE(clock_covers, Clock)->Arg(1000);
+BENCHMARK_TEMPLATE(clock_covers, SparseClock)->Arg(1000);
+
+static void clock_at_many_actors(benchmark::State& state) {
+    auto doc = many_actors(state.range(0));
+    auto heads = doc.get_heads();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(doc.clock_at(heads));
+    }
+}
+BENCHMARK(clock_at_many_actors)->Arg(1000);
+
+static void get_changes_many_actors(benchmark::State& state) {
+    auto doc = many_actors(state.range(0));
+    auto changes = doc.get_changes({});
+    std::vector<ChangeHash> heads = { changes[changes.size() / 2]->hash };
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(doc.get_changes(heads));
+    }
+}
+BENCHMARK(get_changes_many_actors)->Arg(1000)->Arg(10000);
+
+// A long history of single-op changes from a few actors taking turns.
+static Automerge long_history(usize changes) {
+    std::vector<ActorId> actors = { ActorId(true), ActorId(true), ActorId(true) };
+    Automerge doc;
+    for (usize i = 0; i < changes; ++i) {
+        doc.set_actor(ActorId(actors[i % actors.size()]));
+        doc.put(ExId(), Prop("key"), ScalarValue{ ScalarValue::Uint, (u64)i });
+        doc.commit();
+    }
+
+    return doc;
+}
+
+static void get_changes_long_history(benchmark::State& state) {
+    auto doc = long_history(state.range(0));
+    auto changes = doc.get_changes({});
+    // a peer that is 10 changes behind
+    std::vector<ChangeHash> heads = { changes[changes.size() - 10]->hash };
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(doc.get_changes(heads));
+    }
+}
+BENCHMARK(get_changes_long_history)->Arg(10000)->Arg(100000);
+
+static void clock_at_long_history(benchmark::State& state) {
+    auto doc = long_history(state.range(0));
+    auto heads = doc.get_heads();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(doc.clock_at(heads));
+    }
+}
+BENCHMARK(clock_at_long_history)->Arg(10000)->Arg(100000);
@@ -0,0 +1,97 @@
+// Copyright (c) 2022 the VGG Automerge contributors
+// This code is licensed under MIT license (see LICENSE for details)
+
+#include <benchmark/benchmark.h>
+
+#include "ChangeGraph.h"
+
+static ChangeHash node_hash(u64 n) {
+    ChangeHash hash;
+    for (usize i = 0; i < HASH_SIZE; i += sizeof(u64)) {
+        // splitmix64
+        u64 z = (n += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        z ^= z >> 31;
+        std::copy((u8*)&z, (u8*)&z + sizeof(u64), hash.data + i);
+    }
+
+    return hash;
+}
+
+// A graph of `len` changes from 4 actors, each change depends on the one before it and every 16th
+// change merges a concurrent change too. Clock caching is off, so queries walk the whole graph.
+static ChangeGraph graph_of(usize len) {
+    ChangeGraph graph;
+    graph.set_clock_cache(1, 0);
+
+    Change change;
+    change.num_ops = 1;
+    for (u64 i = 0; i < len; ++i) {
+        change.hash = node_hash(i);
+        change.seq = i / 4 + 1;
+        change.start_op = i + 1;
+        change.deps.clear();
+        if (i > 0) {
+            change.deps.push_back(node_hash(i - 1));
+        }
+        if ((i % 16 == 0) && (i > 4)) {
+            change.deps.push_back(node_hash(i - 5));
+        }
+        graph.add_change(change, i % 4);
+    }
+
+    return graph;
+}
+
+static void graph_add_change(benchmark::State& state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(graph_of(state.range(0)));
+    }
+}
+BENCHMARK(graph_add_change)->Arg(1000000)->Unit(benchmark::kMillisecond);
+
+static void graph_traverse_ancestors(benchmark::State& state) {
+    auto graph = graph_of(state.range(0));
+    for (auto _ : state) {
+        usize count = 0;
+        graph.traverse_ancestors({ (u32)(graph.nodes.size() - 1) }, [&count](u32, const ChangeNode&) {
+            ++count;
+            return true;
+            });
+        benchmark::DoNotOptimize(count);
+    }
+}
+BENCHMARK(graph_traverse_ancestors)->Arg(1000000)->Unit(benchmark::kMillisecond);
+
+static void graph_clock_for_heads(benchmark::State& state) {
+    auto graph = graph_of(state.range(0));
+    std::vector<ChangeHash> heads = { node_hash(state.range(0) - 1) };
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(graph.clock_for_heads(heads));
+    }
+}
+BENCHMARK(graph_clock_for_heads)->Arg(1000000)->Unit(benchmark::kMillisecond);
+
+static void graph_is_ancestor(benchmark::State& state) {
+    auto graph = graph_of(state.range(0));
+    // an ancestor of another actor 101 changes back, and a change that is no ancestor
+    auto head = node_hash(state.range(0) - 102);
+    auto ancestor = node_hash(state.range(0) - 203);
+    auto descendant = node_hash(state.range(0) - 1);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(graph.is_ancestor(ancestor, head));
+        benchmark::DoNotOptimize(graph.is_ancestor(descendant, head));
+    }
+}
+BENCHMARK(graph_is_ancestor)->Arg(1000000);
+
+static void graph_common_ancestors(benchmark::State& state) {
+    auto graph = graph_of(state.range(0));
+    std::vector<ChangeHash> heads1 = { node_hash(state.range(0) - 1) };
+    std::vector<ChangeHash> heads2 = { node_hash(state.range(0) - 101) };
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(graph.common_ancestors(heads1, heads2));
+    }
+}
+BENCHMARK(graph_common_ancestors)->Arg(1000000);
@@ -80,7 +80,7 @@ static void map_save_repeated_put(benchmark::State& state) {
         doc.save();
     }
 }
-BENCHMARK(map_save_repeated_put)->Arg(100)->Arg(1000)->Arg(10000);
+BENCHMARK(map_save_repeated_put)->Arg(100)->Arg(1000)->Arg(10000)->Arg(100000);
 
 static void map_save_repeated_increment(benchmark::State& state) {
     auto doc = repeated_increment(state.range(0));
@@ -88,7 +88,7 @@ static void map_save_repeated_increment(benchmark::State& state) {
         doc.save();
     }
 }
-BENCHMARK(map_save_repeated_increment)->Arg(100)->Arg(1000)->Arg(10000);
+BENCHMARK(map_save_repeated_increment)->Arg(100)->Arg(1000)->Arg(10000)->Arg(100000);
 
 static void map_save_increasing_put(benchmark::State& state) {
     auto doc = increasing_put(state.range(0));
@@ -96,7 +96,7 @@ static void map_save_increasing_put(benchmark::State& state) {
         doc.save();
     }
 }
-BENCHMARK(map_save_increasing_put)->Arg(100)->Arg(1000)->Arg(10000);
+BENCHMARK(map_save_increasing_put)->Arg(100)->Arg(1000)->Arg(10000)->Arg(100000);
 
 static void map_save_decreasing_put(benchmark::State& state) {
     auto doc = decreasing_put(state.range(0));
@@ -104,7 +104,67 @@ static void map_save_decreasing_put(benchmark::State& state) {
         doc.save();
     }
 }
-BENCHMARK(map_save_decreasing_put)->Arg(100)->Arg(1000)->Arg(10000);
+BENCHMARK(map_save_decreasing_put)->Arg(100)->Arg(1000)->Arg(10000)->Arg(100000);
+
+// An autosave of a large document after a small edit.
+static void map_autosave_save(benchmark::State& state) {
+    auto doc = increasing_put(state.range(0));
+    doc.save();
+    u64 i = 0;
+    for (auto _ : state) {
+        doc.put(ExId(), Prop("edit"), ScalarValue{ ScalarValue::Uint, ++i });
+        doc.commit();
+        doc.save();
+    }
+}
+BENCHMARK(map_autosave_save)->Arg(10000)->Arg(100000);
+
+static void map_autosave_save_incremental(benchmark::State& state) {
+    auto doc = increasing_put(state.range(0));
+    doc.save();
+    u64 i = 0;
+    for (auto _ : state) {
+        doc.put(ExId(), Prop("edit"), ScalarValue{ ScalarValue::Uint, ++i });
+        doc.commit();
+        doc.save_incremental();
+    }
+}
+BENCHMARK(map_autosave_save_incremental)->Arg(10000)->Arg(100000);
+
+// One put per gesture, each gesture committed, with `group` gestures coalesced into one change.
+static void map_commit_per_gesture(benchmark::State& state) {
+    for (auto _ : state) {
+        Automerge doc;
+        doc.set_group_commit(state.range(1));
+        for (u64 i = 0; i < (u64)state.range(0); ++i) {
+            doc.put(ExId(), Prop("0"), ScalarValue{ ScalarValue::Uint, i });
+            doc.commit();
+        }
+        doc.flush();
+        state.counters["save_bytes"] = (double)doc.save().size();
+    }
+}
+BENCHMARK(map_commit_per_gesture)->Args({ 10000, 0 })->Args({ 10000, 16 })->Args({ 10000, 256 })
+    ->Unit(benchmark::kMillisecond);
+
+// One put per change to the same key, collecting the tombstones every 1000 changes. The collected
+// ops are set aside, not freed, and the save is the same document chunk as without collecting.
+static void map_repeated_put_gc(benchmark::State& state) {
+    for (auto _ : state) {
+        Automerge doc;
+        for (u64 i = 0; i < (u64)state.range(0); ++i) {
+            doc.put(ExId(), Prop("0"), ScalarValue{ ScalarValue::Uint, i });
+            doc.commit();
+            if (i % 1000 == 999) {
+                doc.gc_before(doc.get_heads());
+            }
+        }
+        state.counters["ops"] = (double)doc.ops.len();
+        state.counters["collected"] = (double)doc.ops.collected().size();
+        state.counters["save_bytes"] = (double)doc.save().size();
+    }
+}
+BENCHMARK(map_repeated_put_gc)->Arg(10000)->Arg(100000)->Unit(benchmark::kMillisecond);
 
 static void map_load_repeated_put(benchmark::State& state) {
     auto bytes = repeated_put(state.range(0)).save();
@@ -174,3 +234,107 @@ static void map_apply_decreasing_put(benchmark::State& state) {
     }
 }
 BENCHMARK(map_apply_decreasing_put)->Arg(100)->Arg(1000)->Arg(10000);
+
+// Many changes of ten puts each.
+static Automerge many_changes(u64 n) {
+    Automerge doc;
+    for (u64 i = 0; i < n; ++i) {
+        for (u64 j = 0; j < 10; ++j) {
+            doc.put(ExId(), Prop(std::to_string(j)), ScalarValue{ ScalarValue::Uint, i });
+        }
+        doc.commit();
+    }
+
+    return doc;
+}
+
+static void map_apply_many_changes(benchmark::State& state) {
+    auto changes = vector_of_pointer_to_vector(many_changes(state.range(0)).get_changes({}));
+    for (auto _ : state) {
+        Automerge doc;
+        doc.apply_changes(std::vector(changes));
+    }
+}
+BENCHMARK(map_apply_many_changes)->Arg(10000)->Unit(benchmark::kMillisecond);
+
+static double history_bytes(const Automerge& doc) {
+    usize len = 0;
+    for (auto& change : doc.histroy) {
+        len += change.bytes.raw().second;
+    }
+    return (double)len;
+}
+
+// Compact the whole history of a document of many changes, measuring the bytes the history holds
+// and the size of the saved document before and after.
+static void map_compact_history(benchmark::State& state) {
+    auto source = many_changes(state.range(0));
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto doc = source;
+        state.counters["history_bytes_before"] = history_bytes(doc);
+        state.counters["save_bytes_before"] = (double)doc.snapshot().size();
+        state.ResumeTiming();
+
+        doc.compact(doc.get_heads());
+
+        state.PauseTiming();
+        state.counters["history_bytes_after"] = history_bytes(doc);
+        state.counters["save_bytes_after"] = (double)doc.snapshot().size();
+        state.ResumeTiming();
+    }
+}
+BENCHMARK(map_compact_history)->Arg(10000)->Unit(benchmark::kMillisecond);
+
+// One change per put, applied in reverse topological order so every change but the last is queued.
+static void map_apply_reversed_changes(benchmark::State& state) {
+    Automerge source;
+    for (u64 i = 0; i < (u64)state.range(0); ++i) {
+        source.put(ExId(), Prop("0"), ScalarValue{ ScalarValue::Uint, i });
+        source.commit();
+    }
+    auto changes = vector_of_pointer_to_vector(source.get_changes({}));
+    std::reverse(changes.begin(), changes.end());
+
+    for (auto _ : state) {
+        Automerge doc;
+        doc.apply_changes(std::vector(changes));
+    }
+}
+BENCHMARK(map_apply_reversed_changes)->Arg(1000)->Arg(50000)->Unit(benchmark::kMillisecond);
+
+// A fork of a document of one change per put.
+static void map_fork(benchmark::State& state) {
+    Automerge doc;
+    for (u64 i = 0; i < (u64)state.range(0); ++i) {
+        doc.put(ExId(), Prop(std::to_string(i % 100)), ScalarValue{ ScalarValue::Uint, i });
+        doc.commit();
+    }
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(doc.fork());
+    }
+}
+BENCHMARK(map_fork)->Arg(10000)->Unit(benchmark::kMillisecond);
+
+// A fork of a large document followed by a small edit, as a speculative edit or a preview does.
+// The document has `range(0)` ops, put in changes of a thousand each over a hundred thousand keys.
+static void map_fork_edit(benchmark::State& state) {
+    Automerge doc;
+    for (u64 i = 0; i < (u64)state.range(0); ++i) {
+        doc.put(ExId(), Prop(std::to_string(i % 100000)), ScalarValue{ ScalarValue::Uint, i });
+        if (i % 1000 == 999) {
+            doc.commit();
+        }
+    }
+    doc.commit();
+
+    u64 i = 0;
+    for (auto _ : state) {
+        auto f = doc.fork();
+        f.put(ExId(), Prop(std::to_string(i++ % 100000)), ScalarValue{ ScalarValue::Uint, i });
+        f.commit();
+        benchmark::DoNotOptimize(f);
+    }
+}
+BENCHMARK(map_fork_edit)->Arg(1000000)->Unit(benchmark::kMillisecond);
@@ -0,0 +1,100 @@
+// Copyright (c) 2022 the VGG Automerge contributors
+// This code is licensed under MIT license (see LICENSE for details)
+
+#include <benchmark/benchmark.h>
+
+#include "SyncNetwork.h"
+
+enum Condition {
+    PERFECT,
+    // latency of 1 to 4 rounds, messages of a link overtake each other
+    REORDER,
+    // 10% of the messages lost and 10% delivered twice, with reordering
+    LOSSY,
+};
+
+static SyncNetworkOptions network_options(s64 topology, s64 condition) {
+    SyncNetworkOptions options;
+    options.topology = (SyncTopology)topology;
+    if (condition != PERFECT) {
+        options.jitter = 3;
+    }
+    if (condition == LOSSY) {
+        options.drop = 0.1;
+        options.duplicate = 0.1;
+    }
+
+    return options;
+}
+
+// `peers` documents of `changes` changes each, made concurrently by different actors.
+static std::vector<Automerge> concurrent_docs(usize peers, usize changes) {
+    std::vector<Automerge> docs(peers);
+    for (usize peer = 0; peer < peers; ++peer) {
+        for (u64 i = 0; i < changes; ++i) {
+            docs[peer].put(ExId(), Prop(std::to_string(i % 100)), ScalarValue{ ScalarValue::Uint, i });
+            docs[peer].commit();
+        }
+    }
+
+    return docs;
+}
+
+static void report(benchmark::State& state, const SyncNetworkStats& stats) {
+    if (!stats.converged) {
+        state.SkipWithError("the network did not converge");
+        return;
+    }
+    state.counters["rounds"] = (double)stats.rounds;
+    state.counters["messages"] = (double)stats.messages;
+    state.counters["bytes"] = (double)stats.bytes;
+    state.counters["reconnects"] = (double)stats.reconnects;
+    state.counters["generate_us"] = stats.generate_seconds * 1e6 / stats.messages;
+    state.counters["receive_us"] = stats.receive_seconds * 1e6 / stats.messages;
+}
+
+// 8 peers of 100 changes each, synced from scratch over topology `range(0)` under condition
+// `range(1)`. Reports the rounds to converge, the messages and bytes sent, and the CPU time per
+// message to generate and to receive it.
+static void sync_network(benchmark::State& state) {
+    auto docs = concurrent_docs(8, 100);
+
+    SyncNetworkStats stats;
+    for (auto _ : state) {
+        SyncNetwork network(std::vector<Automerge>(docs), network_options(state.range(0), state.range(1)));
+        stats = network.run();
+    }
+    report(state, stats);
+}
+
+// 8 converged peers each make one more change, only the sync of those is measured.
+static void sync_network_edits(benchmark::State& state) {
+    SyncNetwork converged(concurrent_docs(8, 100), network_options(state.range(0), state.range(1)));
+    converged.run();
+
+    SyncNetworkStats stats;
+    for (auto _ : state) {
+        state.PauseTiming();
+        SyncNetwork network = converged;
+        for (usize peer = 0; peer < network.size(); ++peer) {
+            network.doc(peer).put(ExId(), Prop("edit"), ScalarValue{ ScalarValue::Uint, (u64)peer });
+            network.doc(peer).commit();
+        }
+        state.ResumeTiming();
+
+        stats = network.run();
+    }
+    report(state, stats);
+}
+
+static void network_args(benchmark::internal::Benchmark* benchmark) {
+    for (auto topology : { SyncTopology::Star, SyncTopology::Mesh, SyncTopology::Chain }) {
+        for (auto condition : { PERFECT, REORDER, LOSSY }) {
+            benchmark->Args({ (s64)topology, condition });
+        }
+    }
+    benchmark->ArgNames({ "topology", "condition" })->Unit(benchmark::kMillisecond);
+}
+
+BENCHMARK(sync_network)->Apply(network_args);
+BENCHMARK(sync_network_edits)->Apply(network_args);
@@ -1,9 +1,14 @@
 // Copyright (c) 2022 the VGG Automerge contributors
 // This code is licensed under MIT license (see LICENSE for details)
 
+#if defined(__linux__)
+#include <malloc.h>
+#endif
+
 #include <benchmark/benchmark.h>
 
 #include "Automerge.h"
+#include "SyncHub.h"
 
 static void BM_StringCreation(benchmark::State& state) {
   for (auto _ : state)
@@ -77,4 +82,249 @@ static void sync_unidirectional_every_change(benchmark::State& state) {
 }
 BENCHMARK(sync_unidirectional_every_change)->Arg(100)->Arg(1000)->Arg(10000);
 
+// A relay with `peers` peers in step on a document of 1000 changes, sending them a new change.
+static void relay(benchmark::State& state, bool use_hub) {
+    DocWithSync server = { increasing_put(0), State() };
+    for (u64 i = 0; i < 1000; ++i) {
+        server.doc.put(ExId(), Prop(std::to_string(i)), ScalarValue{ ScalarValue::Str, std::string(300, 'a') });
+        server.doc.commit();
+    }
+    DocWithSync client;
+    sync(server, client);
+
+    server.doc.put(ExId(), Prop("new"), ScalarValue{ ScalarValue::Str, std::string(300, 'b') });
+    server.doc.commit();
+
+    std::vector<State> peer_states(state.range(0), server.peer_state);
+    usize bytes = 0;
+    for (auto _ : state) {
+        auto states = peer_states;
+        SyncHub hub(server.doc);
+        for (auto& peer_state : states) {
+            if (use_hub) {
+                bytes += hub.generate_sync_message(peer_state)->size();
+            }
+            else {
+                bytes += server.doc.generate_sync_message(peer_state)->encode().size();
+            }
+        }
+    }
+    benchmark::DoNotOptimize(bytes);
+}
+
+static void sync_relay_peers(benchmark::State& state) {
+    relay(state, false);
+}
+BENCHMARK(sync_relay_peers)->Arg(10)->Arg(100)->Arg(1000)->Unit(benchmark::kMillisecond);
+
+static void sync_relay_peers_hub(benchmark::State& state) {
+    relay(state, true);
+}
+BENCHMARK(sync_relay_peers_hub)->Arg(10)->Arg(100)->Arg(1000)->Unit(benchmark::kMillisecond);
+
+static SyncMessage message_of(u64 n) {
+    Automerge doc;
+    for (u64 i = 0; i < n; ++i) {
+        doc.put(ExId(), Prop(std::to_string(i)), ScalarValue{ ScalarValue::Str, std::string(300, 'a') });
+        doc.commit();
+    }
+
+    State sync_state;
+    sync_state.their_have = std::vector<Have>{ Have() };
+    sync_state.their_need = std::vector<ChangeHash>();
+
+    return *doc.generate_sync_message(sync_state);
+}
+
+static void sync_message_encode(benchmark::State& state) {
+    auto message = message_of(state.range(0));
+    for (auto _ : state) {
+        auto bytes = message.encode();
+        benchmark::DoNotOptimize(bytes);
+    }
+}
+BENCHMARK(sync_message_encode)->Arg(10)->Arg(100);
+
+static void sync_message_encode_into(benchmark::State& state) {
+    auto message = message_of(state.range(0));
+    std::vector<u8> buf;
+    std::vector<BinSlice> parts;
+    for (auto _ : state) {
+        buf.clear();
+        parts.clear();
+        message.encode_into(buf, parts);
+        benchmark::DoNotOptimize(parts);
+    }
+}
+BENCHMARK(sync_message_encode_into)->Arg(10)->Arg(100);
+
+static void sync_message_decode(benchmark::State& state) {
+    auto bytes = message_of(state.range(0)).encode();
+    for (auto _ : state) {
+        auto message = SyncMessage::decode(make_bin_slice(bytes));
+        benchmark::DoNotOptimize(message);
+    }
+}
+BENCHMARK(sync_message_decode)->Arg(10)->Arg(100);
+
+static void sync_message_decode_view(benchmark::State& state) {
+    auto bytes = message_of(state.range(0)).encode();
+    for (auto _ : state) {
+        auto view = SyncMessageView::decode(make_bin_slice(bytes));
+        benchmark::DoNotOptimize(view);
+    }
+}
+BENCHMARK(sync_message_decode_view)->Arg(10)->Arg(100);
+
+static void sync_message_decode_view_changes(benchmark::State& state) {
+    auto bytes = std::make_shared<const std::vector<u8>>(message_of(state.range(0)).encode());
+    for (auto _ : state) {
+        auto message = SyncMessageView::decode(make_bin_slice(*bytes))->to_message(bytes);
+        benchmark::DoNotOptimize(message);
+    }
+}
+BENCHMARK(sync_message_decode_view_changes)->Arg(10)->Arg(100);
+
+// The message that sends every change of a document of `n` changes to an empty peer.
+static void sync_generate_changes(benchmark::State& state) {
+    Automerge doc;
+    for (s64 i = 0; i < state.range(0); ++i) {
+        doc.put(ExId(), Prop(std::to_string(i % 100)), ScalarValue{ ScalarValue::Int, i });
+        doc.commit();
+    }
+    Automerge peer;
+    State peer_state;
+    auto request = peer.generate_sync_message(peer_state);
+
+    for (auto _ : state) {
+        State sync_state;
+        doc.receive_sync_message(sync_state, SyncMessage(*request));
+        benchmark::DoNotOptimize(doc.generate_sync_message(sync_state));
+    }
+}
+BENCHMARK(sync_generate_changes)->Arg(10000)->Unit(benchmark::kMillisecond);
+
+// An initial sync of a document of `n` changes to an empty peer, with at most `max_changes` changes
+// per message, 0 for one message, and with a snapshot if `snapshot_sync`. Reports the largest
+// message and the bytes sent.
+static void sync_initial(benchmark::State& state) {
+    Automerge doc;
+    for (s64 i = 0; i < state.range(0); ++i) {
+        doc.put(ExId(), Prop(std::to_string(i % 100)), ScalarValue{ ScalarValue::Int, i });
+        doc.commit();
+    }
+
+    usize max_message = 0;
+    usize sent_bytes = 0;
+    for (auto _ : state) {
+        DocWithSync doc1 = { doc, State() };
+        doc1.peer_state.max_message_changes = state.range(1);
+        doc1.peer_state.snapshot_sync = state.range(2);
+        DocWithSync doc2;
+
+        while (true) {
+            bool sent = false;
+            while (auto message = doc1.doc.generate_sync_message(doc1.peer_state)) {
+                auto bytes = message->encode();
+                max_message = std::max(max_message, bytes.size());
+                sent_bytes += bytes.size();
+                doc2.doc.receive_sync_message(doc2.peer_state, std::move(*SyncMessage::decode(make_bin_slice(bytes))));
+                sent = true;
+            }
+
+            auto reply = doc2.doc.generate_sync_message(doc2.peer_state);
+            if (reply) {
+                doc1.doc.receive_sync_message(doc1.peer_state, std::move(*reply));
+            }
+            else if (!sent) {
+                break;
+            }
+        }
+    }
+    state.counters["max_message_bytes"] = (double)max_message;
+    state.counters["sent_bytes"] = (double)sent_bytes;
+}
+BENCHMARK(sync_initial)->Args({ 100000, 0, 0 })->Args({ 100000, 1000, 0 })->Args({ 100000, 0, 1 })
+    ->Unit(benchmark::kMillisecond)->Iterations(1);
+
+// Two peers with 10000 changes in common, got from others, which have never synced with each other,
+// with `range(0)` changes of their own each, summarised by bloom filters or by sketches if
+// `range(1)`. Reports the bytes and round trips of the sync.
+static void sync_reconcile(benchmark::State& state) {
+    Automerge base;
+    for (s64 i = 0; i < 10000; ++i) {
+        base.put(ExId(), Prop(std::to_string(i % 100)), ScalarValue{ ScalarValue::Int, i });
+        base.commit();
+    }
+    std::vector<Automerge> docs = { base.fork(), base.fork() };
+    for (auto& doc : docs) {
+        for (s64 i = 0; i < state.range(0); ++i) {
+            doc.put(ExId(), Prop("own"), ScalarValue{ ScalarValue::Int, i });
+            doc.commit();
+        }
+    }
+
+    usize sent_bytes = 0;
+    usize rounds = 0;
+    for (auto _ : state) {
+        DocWithSync doc1 = { docs[0], State() };
+        DocWithSync doc2 = { docs[1], State() };
+        doc1.peer_state.reconcile_sync = state.range(1);
+        doc2.peer_state.reconcile_sync = state.range(1);
+
+        sent_bytes = 0;
+        rounds = 0;
+        while (true) {
+            auto a_to_b = doc1.doc.generate_sync_message(doc1.peer_state);
+            auto b_to_a = doc2.doc.generate_sync_message(doc2.peer_state);
+            if (!a_to_b && !b_to_a) {
+                break;
+            }
+            if (a_to_b) {
+                auto bytes = a_to_b->encode();
+                sent_bytes += bytes.size();
+                doc2.doc.receive_sync_message(doc2.peer_state, std::move(*SyncMessage::decode(make_bin_slice(bytes))));
+            }
+            if (b_to_a) {
+                auto bytes = b_to_a->encode();
+                sent_bytes += bytes.size();
+                doc1.doc.receive_sync_message(doc1.peer_state, std::move(*SyncMessage::decode(make_bin_slice(bytes))));
+            }
+            ++rounds;
+        }
+    }
+    state.counters["sent_bytes"] = (double)sent_bytes;
+    state.counters["rounds"] = (double)rounds;
+}
+BENCHMARK(sync_reconcile)->ArgsProduct({ { 1, 10, 100 }, { 0, 1 } })->Unit(benchmark::kMillisecond);
+
+// The bytes allocated on the heap, where the allocator can tell.
+static usize heap_in_use() {
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 33))
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+// The memory per peer of a relay with `peers` sessions, each having just been sent the 1000
+// changes of the document, not yet acknowledged.
+static void sync_state_memory(benchmark::State& state) {
+    DocWithSync server = { increasing_put(0), State() };
+    for (u64 i = 0; i < 1000; ++i) {
+        server.doc.put(ExId(), Prop(std::to_string(i % 100)), ScalarValue{ ScalarValue::Uint, i });
+        server.doc.commit();
+    }
+    DocWithSync client;
+    server.doc.receive_sync_message(server.peer_state, std::move(*client.doc.generate_sync_message(client.peer_state)));
+    server.doc.generate_sync_message(server.peer_state);
+
+    for (auto _ : state) {
+        usize before = heap_in_use();
+        std::vector<State> states(state.range(0), server.peer_state);
+        state.counters["bytes_per_peer"] = (double)(heap_in_use() - before) / states.size();
+    }
+}
+BENCHMARK(sync_state_memory)->Arg(10000)->Iterations(1);
+
 BENCHMARK_MAIN();